@@ -0,0 +1,51 @@
+/*
+ * counts operator new calls and prints the total at exit.
+ *
+ * linked into dot_clean_alloc (make bench-alloc) to check that merging
+ * and deleting a sidecar doesn't allocate once things have warmed up.
+ */
+
+#include <atomic>
+#include <new>
+
+#include <stdio.h>
+#include <stdlib.h>
+
+namespace {
+
+	std::atomic<unsigned long> count{0};
+
+	void report() {
+		fprintf(stderr, "allocations: %lu\n", count.load());
+	}
+
+	struct init {
+		init() { atexit(report); }
+	} _init;
+
+	void *allocate(size_t size) {
+		count++;
+		void *vp = malloc(size ? size : 1);
+		if (!vp) throw std::bad_alloc();
+		return vp;
+	}
+
+}
+
+void *operator new(size_t size) { return allocate(size); }
+void *operator new[](size_t size) { return allocate(size); }
+
+void *operator new(size_t size, const std::nothrow_t &) noexcept {
+	count++;
+	return malloc(size ? size : 1);
+}
+
+void *operator new[](size_t size, const std::nothrow_t &) noexcept {
+	count++;
+	return malloc(size ? size : 1);
+}
+
+void operator delete(void *vp) noexcept { free(vp); }
+void operator delete[](void *vp) noexcept { free(vp); }
+void operator delete(void *vp, size_t) noexcept { free(vp); }
+void operator delete[](void *vp, size_t) noexcept { free(vp); }
@@ -0,0 +1,153 @@
+#ifndef __applefile_view_h__
+#define __applefile_view_h__
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "applefile.h"
+
+/*
+ * a read-only view of an AppleSingle / AppleDouble file in memory.
+ *
+ * parse() checks the header and the entry table once -- every entry has to
+ * lie within the buffer -- and indexes the standard entry ids.  after that
+ * find() is a table lookup and the accessors read the big endian fields in
+ * place, so the buffer is never copied, byte swapped or written to (and a
+ * read-only mapping is enough).
+ *
+ *     applefile_view v;
+ *     if (v.parse(data, size) != applefile_view::valid) ...
+ *     auto e = v.find(AS_RESOURCE);
+ *     if (e) write(fd, v.data(e), e.length());
+ *
+ * the view doesn't own the buffer.  versions are left to the caller.
+ */
+
+class applefile_view {
+public:
+
+	enum status {
+		valid = 0,
+		not_applefile,	// too short for a header, or the wrong magic number.
+		truncated,		// the entry table or an entry runs past the end.
+	};
+
+	class entry {
+	public:
+		entry() = default;
+
+		uint32_t id() const { return load32(_p); }
+		uint32_t offset() const { return load32(_p + 4); }
+		uint32_t length() const { return load32(_p + 8); }
+
+		explicit operator bool() const { return _p != nullptr; }
+
+	private:
+		friend class applefile_view;
+		explicit entry(const unsigned char *p) : _p(p) {}
+		const unsigned char *_p = nullptr;
+	};
+
+
+	applefile_view() = default;
+
+	/*
+	 * just the header, which is all a file's type needs.  entries aren't
+	 * available.
+	 */
+	status parse_header(const void *data, size_t size) {
+		reset();
+		if (size < sizeof(ASHeader)) return not_applefile;
+
+		const unsigned char *p = (const unsigned char *)data;
+		uint32_t m = load32(p);
+		if (m != APPLESINGLE_MAGIC && m != APPLEDOUBLE_MAGIC) return not_applefile;
+
+		_buffer = p;
+		_size = size;
+		return valid;
+	}
+
+	status parse(const void *data, size_t size) {
+		status st = parse_header(data, size);
+		if (st != valid) return st;
+
+		unsigned n = load16(_buffer + 24);
+		if (sizeof(ASHeader) + n * sizeof(ASEntry) > _size) return fail(truncated);
+
+		// in 64 bits so offset + length can't wrap.  a later entry replaces
+		// an earlier one; empty entries are skipped.
+		for (unsigned i = 0; i < n; ++i) {
+			entry e = (*this)[i];
+			uint64_t length = e.length();
+			if (!length) continue;
+			if ((uint64_t)e.offset() + length > _size) return fail(truncated);
+			uint32_t id = e.id();
+			if (id < max_indexed) _index[id] = i + 1;
+		}
+
+		_count = n;
+		return valid;
+	}
+
+	const unsigned char *begin() const { return _buffer; }
+	size_t size() const { return _size; }
+
+	uint32_t magic() const { return load32(_buffer); }
+	uint32_t version() const { return load32(_buffer + 4); }
+
+	// entries, in file order.
+	unsigned count() const { return _count; }
+	entry operator[](unsigned i) const {
+		return entry(_buffer + sizeof(ASHeader) + i * sizeof(ASEntry));
+	}
+
+	/*
+	 * the last non-empty entry with this id (or a false entry).  ids past
+	 * the standard ones are a linear search.
+	 */
+	entry find(uint32_t id) const {
+		if (id < max_indexed) {
+			unsigned i = _index[id];
+			return i ? (*this)[i - 1] : entry();
+		}
+		for (unsigned i = _count; i--; ) {
+			entry e = (*this)[i];
+			if (e.id() == id && e.length()) return e;
+		}
+		return entry();
+	}
+
+	const unsigned char *data(const entry &e) const { return _buffer + e.offset(); }
+
+private:
+
+	static const unsigned max_indexed = AS_AFPDIRID + 1;
+
+	static uint32_t load32(const unsigned char *p) {
+		return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) | ((uint32_t)p[2] << 8) | p[3];
+	}
+
+	static unsigned load16(const unsigned char *p) {
+		return (p[0] << 8) | p[1];
+	}
+
+	void reset() {
+		_buffer = nullptr;
+		_size = 0;
+		_count = 0;
+		for (auto &i : _index) i = 0;
+	}
+
+	status fail(status st) {
+		reset();
+		return st;
+	}
+
+	const unsigned char *_buffer = nullptr;
+	size_t _size = 0;
+	unsigned _count = 0;
+	uint16_t _index[max_indexed] = {};
+};
+
+#endif
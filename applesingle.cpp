@@ -31,6 +31,7 @@
 #include <afp/resource_fork.h>
 
 #include "applefile.h"
+#include "applefile_view.h"
 
 #ifndef O_BINARY
 #define O_BINARY 0
@@ -62,13 +63,9 @@ int _rv = 0;
 
 /* check if a file is apple single or apple double format (or neither). */
 uint32_t classify(const mapped_file &mf) {
-	if (mf.size() < sizeof(ASHeader)) return 0;
-
-	const ASHeader *header = (const ASHeader *)mf.data();
-	if (header->magicNum == htonl(APPLESINGLE_MAGIC)) return APPLESINGLE_MAGIC;
-	if (header->magicNum == htonl(APPLEDOUBLE_MAGIC)) return APPLEDOUBLE_MAGIC;
-
-	return 0;
+	applefile_view v;
+	if (v.parse_header(mf.data(), mf.size()) != applefile_view::valid) return 0;
+	return v.magic();
 }
 
 /*
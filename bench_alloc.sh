@@ -0,0 +1,58 @@
+#!/bin/sh
+#
+# make bench-alloc: runs dot_clean_alloc over a directory of n and then 2n
+# sidecars and fails if the extra n cost more than a few allocations (the
+# odd container growing is fine; one per sidecar isn't).
+#
+# usage: bench_alloc.sh ./dot_clean_alloc [dot_clean options]
+#
+
+bin=$1
+shift
+n=${BENCH_FILES:-2000}
+slack=32
+
+dir=$(mktemp -d "${TMPDIR:-/tmp}/dot_clean_alloc.XXXXXX") || exit 1
+trap 'rm -rf "$dir"' EXIT
+
+# a 42 byte Apple Double file with a 4 byte resource fork.
+sidecar() {
+	printf '\000\005\026\007\000\002\000\000' > "$1"
+	printf '\000\000\000\000\000\000\000\000\000\000\000\000\000\000\000\000' >> "$1"
+	printf '\000\001\000\000\000\002\000\000\000\046\000\000\000\004rsrc' >> "$1"
+}
+
+# allocations for a run over $1 sidecars (and the rest as options).
+count() {
+	files=$1
+	shift
+	rm -rf "$dir/t"
+	mkdir "$dir/t" || exit 1
+	i=0
+	while [ $i -lt $files ]; do
+		: > "$dir/t/file-with-a-longish-name-$i"
+		sidecar "$dir/t/._file-with-a-longish-name-$i"
+		i=$((i + 1))
+	done
+	"$bin" "$@" "$dir/t" 2>&1 >/dev/null | sed -n 's/^allocations: //p'
+}
+
+a=$(count $n "$@")
+b=$(count $((2 * n)) "$@")
+if [ -z "$a" ] || [ -z "$b" ]; then
+	echo "bench-alloc: no allocation count from $bin" >&2
+	exit 1
+fi
+
+if [ -n "$(ls -A "$dir/t" | grep '^\._')" ]; then
+	echo "bench-alloc: sidecars weren't merged (does $dir support xattrs?)" >&2
+	exit 1
+fi
+
+extra=$((b - a))
+echo "$n sidecars: $a allocations, $((2 * n)): $b (+$extra)"
+if [ $extra -gt $slack ]; then
+	echo "bench-alloc: sidecars are allocating" >&2
+	exit 1
+fi
+exit 0
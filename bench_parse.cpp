@@ -0,0 +1,141 @@
+/*
+ * make bench-parse: how long applefile_view takes to parse a sidecar and
+ * find its entries, next to the old way (copy the header and entry table
+ * out and byte swap them).
+ *
+ * usage: bench_parse [iterations]
+ */
+
+#include <chrono>
+#include <vector>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef _WIN32
+#include <winsock2.h>
+#else
+#include <arpa/inet.h>
+#endif
+
+#include "applefile.h"
+#include "applefile_view.h"
+
+namespace {
+
+	void put32(std::vector<unsigned char> &v, uint32_t x) {
+		v.push_back(x >> 24);
+		v.push_back(x >> 16);
+		v.push_back(x >> 8);
+		v.push_back(x);
+	}
+
+	/*
+	 * n entries (the first two are the Finder info and the resource fork
+	 * dot_clean looks for) and 4K of resource fork, like a ._ file from a
+	 * Mac.
+	 */
+	std::vector<unsigned char> sidecar(unsigned n) {
+		std::vector<unsigned char> v;
+		put32(v, APPLEDOUBLE_MAGIC);
+		put32(v, 0x00020000);
+		v.resize(v.size() + 16);
+		v.push_back(n >> 8);
+		v.push_back(n);
+
+		uint32_t offset = sizeof(ASHeader) + n * sizeof(ASEntry);
+		for (unsigned i = 0; i < n; ++i) {
+			uint32_t id = i == 0 ? AS_FINDERINFO : i == 1 ? AS_RESOURCE : AS_COMMENT;
+			uint32_t length = i == 0 ? 32 : i == 1 ? 4096 : 16;
+			put32(v, id);
+			put32(v, offset);
+			put32(v, length);
+			offset += length;
+		}
+		v.resize(offset, 'x');
+		return v;
+	}
+
+	// what dot_clean did before applefile_view.
+	uint32_t old_parse(const unsigned char *data, size_t size) {
+		ASHeader header;
+		if (size < sizeof(header)) return 0;
+		memcpy(&header, data, sizeof(header));
+		header.magicNum = ntohl(header.magicNum);
+		header.versionNum = ntohl(header.versionNum);
+		header.numEntries = ntohs(header.numEntries);
+		if (header.magicNum != APPLEDOUBLE_MAGIC) return 0;
+
+		unsigned n = header.numEntries;
+		if (sizeof(header) + n * sizeof(ASEntry) > size) return 0;
+
+		ASEntry entries[64];
+		if (n > 64) return 0;
+		memcpy(entries, data + sizeof(header), n * sizeof(ASEntry));
+
+		// once to check...
+		for (unsigned i = 0; i < n; ++i) {
+			ASEntry e = entries[i];
+			e.entryOffset = ntohl(e.entryOffset);
+			e.entryLength = ntohl(e.entryLength);
+			if ((uint64_t)e.entryOffset + e.entryLength > size) return 0;
+		}
+
+		// ...and again to use.
+		uint32_t rv = 0;
+		for (unsigned i = 0; i < n; ++i) {
+			ASEntry &e = entries[i];
+			e.entryID = ntohl(e.entryID);
+			e.entryOffset = ntohl(e.entryOffset);
+			e.entryLength = ntohl(e.entryLength);
+			if (e.entryID == AS_RESOURCE || e.entryID == AS_FINDERINFO) rv += data[e.entryOffset];
+		}
+		return rv;
+	}
+
+	uint32_t view_parse(const unsigned char *data, size_t size) {
+		applefile_view v;
+		if (v.parse(data, size) != applefile_view::valid) return 0;
+		if (v.magic() != APPLEDOUBLE_MAGIC) return 0;
+
+		uint32_t rv = 0;
+		auto e = v.find(AS_RESOURCE);
+		if (e) rv += *v.data(e);
+		e = v.find(AS_FINDERINFO);
+		if (e) rv += *v.data(e);
+		return rv;
+	}
+
+	template<class FX>
+	double time(FX fx, const std::vector<unsigned char> &v, unsigned long iterations) {
+		typedef std::chrono::steady_clock clock;
+
+		volatile uint32_t sink = 0;
+		auto start = clock::now();
+		for (unsigned long i = 0; i < iterations; ++i) sink += fx(v.data(), v.size());
+		std::chrono::duration<double, std::nano> d = clock::now() - start;
+		(void)sink;
+		return d.count() / iterations;
+	}
+
+}
+
+int main(int argc, char **argv) {
+
+	unsigned long iterations = argc > 1 ? strtoul(argv[1], nullptr, 10) : 10000000;
+	if (!iterations) iterations = 1;
+
+	static const unsigned counts[] = { 2, 8, 32 };
+	for (unsigned n : counts) {
+		auto v = sidecar(n);
+		if (old_parse(v.data(), v.size()) != view_parse(v.data(), v.size())) {
+			fprintf(stderr, "bench_parse: the parsers disagree (%u entries)\n", n);
+			return 1;
+		}
+		double a = time(old_parse, v, iterations);
+		double b = time(view_parse, v, iterations);
+		printf("%2u entries: %6.1f ns old, %6.1f ns applefile_view\n", n, a, b);
+	}
+	return 0;
+}
@@ -0,0 +1,102 @@
+#include "crc32c.h"
+
+#include <string.h>
+
+#if defined(__x86_64__) && (defined(__GNUC__) || defined(__clang__))
+#define CRC32C_SSE42 1
+#include <nmmintrin.h>
+#elif defined(__ARM_FEATURE_CRC32) && !defined(__ARM_BIG_ENDIAN)
+#define CRC32C_ARM 1
+#include <arm_acle.h>
+#endif
+
+namespace {
+
+	const uint32_t poly = 0x82f63b78; // reflected
+
+	struct tables {
+		uint32_t t[8][256];
+
+		tables() {
+			for (unsigned i = 0; i < 256; ++i) {
+				uint32_t crc = i;
+				for (int k = 0; k < 8; ++k) crc = (crc >> 1) ^ (poly & (0 - (crc & 1)));
+				t[0][i] = crc;
+			}
+			for (unsigned i = 0; i < 256; ++i) {
+				for (int k = 1; k < 8; ++k)
+					t[k][i] = (t[k - 1][i] >> 8) ^ t[0][t[k - 1][i] & 0xff];
+			}
+		}
+	};
+
+	uint32_t load32le(const unsigned char *p) {
+		return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+	}
+
+	uint32_t crc32c_sw(uint32_t crc, const unsigned char *p, size_t size) {
+		static const tables tab;
+		const auto &t = tab.t;
+
+		while (size >= 8) {
+			uint32_t lo = crc ^ load32le(p);
+			uint32_t hi = load32le(p + 4);
+			crc = t[7][lo & 0xff] ^ t[6][(lo >> 8) & 0xff] ^ t[5][(lo >> 16) & 0xff] ^ t[4][lo >> 24]
+				^ t[3][hi & 0xff] ^ t[2][(hi >> 8) & 0xff] ^ t[1][(hi >> 16) & 0xff] ^ t[0][hi >> 24];
+			p += 8;
+			size -= 8;
+		}
+		while (size--) crc = (crc >> 8) ^ t[0][(crc ^ *p++) & 0xff];
+		return crc;
+	}
+
+#if defined(CRC32C_SSE42)
+
+	__attribute__((target("sse4.2")))
+	uint32_t crc32c_hw(uint32_t crc, const unsigned char *p, size_t size) {
+		uint64_t c = crc;
+		while (size >= 8) {
+			uint64_t v;
+			memcpy(&v, p, 8);
+			c = _mm_crc32_u64(c, v);
+			p += 8;
+			size -= 8;
+		}
+		crc = (uint32_t)c;
+		while (size--) crc = _mm_crc32_u8(crc, *p++);
+		return crc;
+	}
+
+	bool have_hw() {
+		static const bool rv = __builtin_cpu_supports("sse4.2");
+		return rv;
+	}
+
+#elif defined(CRC32C_ARM)
+
+	uint32_t crc32c_hw(uint32_t crc, const unsigned char *p, size_t size) {
+		while (size >= 8) {
+			uint64_t v;
+			memcpy(&v, p, 8);
+			crc = __crc32cd(crc, v);
+			p += 8;
+			size -= 8;
+		}
+		while (size--) crc = __crc32cb(crc, *p++);
+		return crc;
+	}
+
+	bool have_hw() { return true; }
+
+#endif
+
+}
+
+uint32_t crc32c(uint32_t crc, const void *data, size_t size) {
+	const unsigned char *p = (const unsigned char *)data;
+	crc = ~crc;
+	#if defined(CRC32C_SSE42) || defined(CRC32C_ARM)
+	if (have_hw()) return ~crc32c_hw(crc, p, size);
+	#endif
+	return ~crc32c_sw(crc, p, size);
+}
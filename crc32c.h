@@ -0,0 +1,22 @@
+#ifndef __crc32c_h__
+#define __crc32c_h__
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * crc32c (castagnoli), as used by iscsi, ext4 and btrfs.
+ *
+ * the sse 4.2 crc32 instruction (checked for at run time) or the armv8 crc
+ * extension (when compiled for it) do 8 bytes an instruction; otherwise
+ * it's slice-by-8 tables.
+ *
+ * crc is the running value, so a buffer can be done in pieces:
+ *
+ *     uint32_t crc = crc32c(0, a, a_size);
+ *     crc = crc32c(crc, b, b_size);
+ */
+
+uint32_t crc32c(uint32_t crc, const void *data, size_t size);
+
+#endif
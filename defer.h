@@ -2,25 +2,34 @@
 #define __defer_h__
 
 #include <utility>
-#include <functional>
 
+/*
+ * runs fx when it goes out of scope (unless cancelled).
+ *
+ *     auto close_fd = defer([fd]{ close(fd); });
+ *
+ * the lambda is stored as is, so there's no std::function (or allocation).
+ */
 
-class defer {
+template<class FX>
+class deferred {
 public:
-	typedef std::function<void()> FX;
-	defer() = default;
+	explicit deferred(FX &&fx) : _fx(std::move(fx)) {}
+	deferred(deferred &&rhs) : _fx(std::move(rhs._fx)), _active(rhs._active) { rhs._active = false; }
+	deferred(const deferred &) = delete;
+	deferred & operator=(const deferred &) = delete;
+	deferred & operator=(deferred &&) = delete;
 
-	defer(FX &&fx) : _fx(std::forward<FX>(fx)) {}
-	defer(const defer &) = delete;
-	defer(defer &&) = default;
-	defer & operator=(const defer &) = delete;
-	defer & operator=(defer &&) = default;
-
-	void cancel() { _fx = nullptr;  }
-	~defer() { if (_fx) _fx(); }
+	void cancel() { _active = false; }
+	~deferred() { if (_active) _fx(); }
 private:
 	FX _fx;
+	bool _active = true;
 };
 
+template<class FX>
+deferred<FX> defer(FX fx) {
+	return deferred<FX>(std::move(fx));
+}
 
 #endif
@@ -0,0 +1,247 @@
+#include "dir_scanner.h"
+#include "uring.h"
+
+#include <errno.h>
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <utility>
+
+#include <sys/stat.h>
+
+#ifdef _WIN32
+#include "win.h"
+#endif
+
+#ifdef __linux__
+#include <sys/syscall.h>
+#endif
+
+#ifndef AT_SYMLINK_NOFOLLOW
+#define AT_SYMLINK_NOFOLLOW 0
+#endif
+
+namespace {
+
+	unsigned char mode_to_type(mode_t mode) {
+		if (S_ISDIR(mode)) return DT_DIR;
+		if (S_ISREG(mode)) return DT_REG;
+		#ifdef S_ISLNK
+		if (S_ISLNK(mode)) return DT_LNK;
+		#endif
+		return DT_UNKNOWN;
+	}
+
+	bool is_dot_or_dot_dot(const char *name) {
+		return name[0] == '.' && (name[1] == 0 || (name[1] == '.' && name[2] == 0));
+	}
+}
+
+
+dir_scanner::dir_scanner(dir_scanner &&rhs) {
+	*this = std::move(rhs);
+}
+
+dir_scanner &dir_scanner::operator=(dir_scanner &&rhs) {
+	if (this == &rhs) return *this;
+	close();
+
+	std::swap(_fd, rhs._fd);
+	std::swap(_need_type, rhs._need_type);
+	std::swap(_ring, rhs._ring);
+#ifdef __linux__
+	std::swap(_buffer, rhs._buffer);
+	std::swap(_offset, rhs._offset);
+	std::swap(_size, rhs._size);
+#else
+	std::swap(_dirp, rhs._dirp);
+#endif
+	return *this;
+}
+
+
+#ifdef __linux__
+
+namespace {
+
+	struct linux_dirent64 {
+		uint64_t d_ino;
+		int64_t d_off;
+		unsigned short d_reclen;
+		unsigned char d_type;
+		char d_name[];
+	};
+
+}
+
+bool dir_scanner::open(int fd, type_filter need_type, uring *ring) {
+	close();
+
+	_buffer = (char *)malloc(buffer_size);
+	if (!_buffer) return false;
+
+	_fd = fd;
+	_need_type = need_type;
+	_ring = ring;
+	_offset = _size = 0;
+
+	// the descriptor may have been read from before (and is shared with dups).
+	if (lseek(_fd, 0, SEEK_SET) < 0) {
+		close();
+		return false;
+	}
+	return true;
+}
+
+void dir_scanner::close() {
+	free(_buffer);
+	_buffer = nullptr;
+	_fd = -1;
+	_offset = _size = 0;
+}
+
+bool dir_scanner::next(entry &e) {
+
+	for(;;) {
+		if (_offset >= _size) {
+			long n = syscall(SYS_getdents64, _fd, _buffer, buffer_size);
+			if (n <= 0) {
+				if (n == 0) errno = 0;
+				return false;
+			}
+			_offset = 0;
+			_size = n;
+			if (_need_type) resolve_types();
+		}
+
+		linux_dirent64 *dp = (linux_dirent64 *)(_buffer + _offset);
+		_offset += dp->d_reclen;
+
+		if (is_dot_or_dot_dot(dp->d_name)) continue;
+
+		e.name = dp->d_name;
+		e.length = strlen(dp->d_name);
+		e.type = dp->d_type;
+		e.ino = dp->d_ino;
+		return true;
+	}
+}
+
+/*
+ * fill in d_type for the DT_UNKNOWN entries in the buffer that the caller
+ * wants, all at once.
+ */
+void dir_scanner::resolve_types() {
+
+	#ifdef HAVE_IO_URING
+	if (_ring) {
+		enum { batch = 64 };
+		struct statx stx[batch];
+		linux_dirent64 *pending[batch];
+		int results[batch];
+		unsigned count = 0;
+
+		auto drain = [&]{
+			_ring->drain([&results](uint64_t i, int res){ results[i] = res; });
+			for (unsigned i = 0; i < count; ++i) {
+				if (results[i] == 0) pending[i]->d_type = mode_to_type(stx[i].stx_mode);
+			}
+			count = 0;
+		};
+
+		for (size_t offset = 0; offset < _size; ) {
+			linux_dirent64 *dp = (linux_dirent64 *)(_buffer + offset);
+			offset += dp->d_reclen;
+
+			if (dp->d_type != DT_UNKNOWN || is_dot_or_dot_dot(dp->d_name)) continue;
+			if (!_need_type(dp->d_name, strlen(dp->d_name))) continue;
+
+			io_uring_sqe *sqe = _ring->get_sqe();
+			if (!sqe) {
+				drain();
+				sqe = _ring->get_sqe();
+			}
+			prep_statx(sqe, _fd, dp->d_name, AT_SYMLINK_NOFOLLOW, STATX_TYPE, &stx[count]);
+			sqe->user_data = count;
+			pending[count++] = dp;
+			if (count == batch) drain();
+		}
+		drain();
+		return;
+	}
+	#endif
+
+	for (size_t offset = 0; offset < _size; ) {
+		linux_dirent64 *dp = (linux_dirent64 *)(_buffer + offset);
+		offset += dp->d_reclen;
+
+		if (dp->d_type != DT_UNKNOWN || is_dot_or_dot_dot(dp->d_name)) continue;
+		if (!_need_type(dp->d_name, strlen(dp->d_name))) continue;
+
+		struct stat st;
+		if (fstatat(_fd, dp->d_name, &st, AT_SYMLINK_NOFOLLOW) == 0)
+			dp->d_type = mode_to_type(st.st_mode);
+	}
+}
+
+#else
+
+bool dir_scanner::open(int fd, type_filter need_type, uring *ring) {
+	close();
+
+	// fdopendir takes ownership of the descriptor, so hand it a copy.
+	int tmp = dup(fd);
+	if (tmp < 0) return false;
+	_dirp = fdopendir(tmp);
+	if (!_dirp) {
+		::close(tmp);
+		return false;
+	}
+	rewinddir(_dirp);
+
+	_fd = fd;
+	_need_type = need_type;
+	_ring = ring;
+	return true;
+}
+
+void dir_scanner::close() {
+	if (_dirp) closedir(_dirp);
+	_dirp = nullptr;
+	_fd = -1;
+}
+
+bool dir_scanner::next(entry &e) {
+	for(;;) {
+		errno = 0;
+		dirent *dp = readdir(_dirp);
+		if (!dp) return false;
+
+		if (is_dot_or_dot_dot(dp->d_name)) continue;
+
+		e.name = dp->d_name;
+		e.length = strlen(dp->d_name);
+		#if defined(DT_DIR) && !defined(_WIN32)
+		e.type = dp->d_type;
+		#else
+		e.type = DT_UNKNOWN;
+		#endif
+		#ifndef _WIN32
+		e.ino = dp->d_ino;
+		#else
+		e.ino = 0;
+		#endif
+
+		if (e.type == DT_UNKNOWN && _need_type && _need_type(e.name, e.length)) {
+			struct stat st;
+			if (fstatat(_fd, e.name, &st, AT_SYMLINK_NOFOLLOW) == 0)
+				e.type = mode_to_type(st.st_mode);
+		}
+		return true;
+	}
+}
+
+void dir_scanner::resolve_types() {}
+
+#endif
@@ -0,0 +1,76 @@
+#ifndef __dir_scanner_h__
+#define __dir_scanner_h__
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <sys/types.h>
+#include <dirent.h>
+
+#ifndef DT_UNKNOWN
+#define DT_UNKNOWN 0
+#define DT_DIR 4
+#define DT_REG 8
+#define DT_LNK 10
+#endif
+
+class uring;
+
+/*
+ * reads a directory a buffer at a time.  on linux that's getdents64 straight
+ * into our buffer, elsewhere readdir().  names are handed out in place
+ * (no copies); they're valid until the next call to next().
+ *
+ * entries the filesystem reports as DT_UNKNOWN are resolved with fstatat
+ * (or a batch of io_uring statx requests) a buffer at a time, but only for
+ * names the caller cares about -- see need_type.
+ */
+class dir_scanner {
+public:
+
+	struct entry {
+		const char *name;
+		size_t length;
+		unsigned char type; // DT_xxx
+		uint64_t ino; // 0 if the platform doesn't say.
+	};
+
+	// return true if the entry's type is needed when the filesystem doesn't say.
+	typedef bool (*type_filter)(const char *name, size_t length);
+
+	dir_scanner() = default;
+	dir_scanner(const dir_scanner &) = delete;
+	dir_scanner &operator=(const dir_scanner &) = delete;
+	dir_scanner(dir_scanner &&);
+	dir_scanner &operator=(dir_scanner &&);
+	~dir_scanner() { close(); }
+
+	// fd is borrowed and must stay open while the scanner is.
+	bool open(int fd, type_filter need_type = nullptr, uring *ring = nullptr);
+	void close();
+
+	bool is_open() const { return _fd >= 0; }
+
+	// false at the end of the directory or on error (errno is then non-zero).
+	bool next(entry &e);
+
+private:
+
+	void resolve_types();
+
+	int _fd = -1;
+	type_filter _need_type = nullptr;
+	uring *_ring = nullptr;
+
+#ifdef __linux__
+	enum { buffer_size = 32 * 1024 };
+
+	char *_buffer = nullptr;
+	size_t _offset = 0;
+	size_t _size = 0;
+#else
+	DIR *_dirp = nullptr;
+#endif
+};
+
+#endif
@@ -7,13 +7,25 @@
 #include <functional>
 #include <system_error>
 #include <utility>
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+#include <chrono>
+#include <unordered_set>
+#include <unordered_map>
+#include <map>
+#include <set>
 
 #include <unistd.h>
+#include <getopt.h>
 #include <fcntl.h>
 #include <errno.h>
 #include <stdlib.h>
 #include <string.h>
 #include <stdio.h>
+#include <signal.h>
 
 
 #ifdef _WIN32
@@ -21,452 +33,3305 @@
 #else
 
 #include <err.h>
-#include <arpa/inet.h>
 #include <sysexits.h>
+#include <sys/resource.h>
+#include <sys/mman.h>
 
 #endif
 
 #include <sys/types.h>
 #include <sys/stat.h>
-#include <dirent.h>
 
-#include <afp/finder_info.h>
-#include <afp/resource_fork.h>
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+#include <arm_neon.h>
+#endif
+
+#include "applefile.h"
+#include "applefile_view.h"
+#include "mapped_file.h"
+#include "forks.h"
+#include "crc32c.h"
+#include "defer.h"
+#include "work_pool.h"
+#include "uring.h"
+#include "dir_scanner.h"
+#include "name_index.h"
+#include "mpmc_queue.h"
+#include "watch.h"
+
+
+#ifndef O_BINARY
+#define O_BINARY 0
+#endif
+
+#ifndef O_DIRECTORY
+#define O_DIRECTORY 0
+#endif
+
+#ifndef O_NOFOLLOW
+#define O_NOFOLLOW 0
+#endif
+
+// for directory descriptors (win.h has its own).
+#ifndef close_dir
+#define close_dir close
+#endif
+
+
+bool _f = false;
+bool _m = false;
+bool _n = false;
+bool _p = false;
+bool _s = false;
+bool _d = false;
+unsigned _v = 0;
+unsigned _j = 1;
+unsigned _merge_jobs = 0; // 0: same as -j
+unsigned _delete_jobs = 1;
+size_t _max_mapped = 256 << 20;
+unsigned _prefetch = 32; // most sidecars read ahead per merge worker
+// descriptor budgets, from the descriptor limit where there is one.
+unsigned _max_dir_fds = 256; // directories held open by the scan and queued jobs
+unsigned _merge_fds = 1024; // per merge worker, for a batch's sidecars and data files
+bool _u = false;
+bool _trash = false;
+bool _inode_order = false;
+bool _background = false;
+bool _durable = false;
+bool _skip_identical = false;
+bool _verify = false;
+
+std::atomic<int> _rv{0};
+
+
+
+
+/*
+ * a bad sidecar isn't exceptional -- some shares are full of ._ files other
+ * tools made -- so merges report failure with a merge_error, not a throw.
+ */
+enum class sidecar_errc {
+	not_apple_double = 1,
+	truncated,
+	damaged,
+	not_verified,
+};
+
+class sidecar_category_impl : public std::error_category {
+public:
+	const char *name() const noexcept override { return "sidecar"; }
+
+	std::string message(int ev) const override {
+		switch (static_cast<sidecar_errc>(ev)) {
+			case sidecar_errc::not_apple_double: return "Not an Apple Double File";
+			case sidecar_errc::truncated: return "Unexpected end of file.";
+			case sidecar_errc::damaged: return "File is damaged.";
+			case sidecar_errc::not_verified: return "Fork doesn't match the sidecar after writing.";
+		}
+		return "Unknown error";
+	}
+};
+
+const std::error_category &sidecar_category() {
+	static sidecar_category_impl category;
+	return category;
+}
+
+// counted by kind, for the summary with -v.
+enum failure_kind {
+	failed_not_apple_double,
+	failed_truncated,
+	failed_damaged,
+	failed_io,
+	failed_forks,
+	failed_verify,
+	failed_other,
+	failure_kinds
+};
+
+std::atomic<unsigned> _failures[failure_kinds];
+
+/*
+ * why a merge failed.  what is the call that failed ("open"), printed
+ * before the message the way system_error would.
+ */
+struct merge_error {
+	std::error_code ec;
+	const char *what = nullptr;
+	failure_kind kind = failed_other;
+
+	explicit operator bool() const { return (bool)ec; }
+};
+
+// these all return false, so a failing step can return them.
+bool set_error(merge_error &err, sidecar_errc e) {
+	err.ec = std::error_code(static_cast<int>(e), sidecar_category());
+	err.what = nullptr;
+	switch (e) {
+		case sidecar_errc::not_apple_double: err.kind = failed_not_apple_double; break;
+		case sidecar_errc::truncated: err.kind = failed_truncated; break;
+		case sidecar_errc::damaged: err.kind = failed_damaged; break;
+		case sidecar_errc::not_verified: err.kind = failed_verify; break;
+	}
+	return false;
+}
+
+bool set_errno(merge_error &err, int e, const char *what) {
+	err.ec = std::error_code(e, std::generic_category());
+	err.what = what;
+	err.kind = failed_io;
+	return false;
+}
+
+bool set_errno(merge_error &err, const char *what) {
+	return set_errno(err, errno, what);
+}
+
+bool set_fork_error(merge_error &err, const std::error_code &ec, const char *what) {
+	err.ec = ec;
+	err.what = what;
+	err.kind = failed_forks;
+	return false;
+}
+
+
+
+/*
+ * spent directory listings, so the next directory reuses one that has
+ * already grown instead of starting from nothing.  big ones are freed.
+ */
+class listing_pool {
+public:
+	std::unique_ptr<name_index> get() {
+		std::lock_guard<std::mutex> lk(_mutex);
+		if (_free.empty()) return std::unique_ptr<name_index>(new name_index);
+		std::unique_ptr<name_index> rv = std::move(_free.back());
+		_free.pop_back();
+		return rv;
+	}
+
+	void put(std::unique_ptr<name_index> index) {
+		if (!index || index->memory() > max_memory) return;
+		index->clear();
+		std::lock_guard<std::mutex> lk(_mutex);
+		if (_free.size() < max_free) _free.push_back(std::move(index));
+	}
+
+private:
+	static const size_t max_free = 64;
+	static const size_t max_memory = 256 * 1024;
+
+	std::mutex _mutex;
+	std::vector<std::unique_ptr<name_index>> _free;
+};
+
+listing_pool _listings;
+
+/*
+ * --trash: a merged .AppleDouble folder is renamed into a trash folder at
+ * the top of its tree -- one metadata operation, where deleting it takes
+ * an unlink per sidecar and an rmdir -- and dot_clean --purge empties the
+ * trash later.  a folder that can't go whole (something in it wasn't
+ * merged, or the trash is on another filesystem) is cleaned as usual.
+ */
+const char *trash_name = ".dot_clean_trash";
+
+class trash_bin {
+public:
+	explicit trash_bin(std::string path) : _path(std::move(path)) {}
+	~trash_bin() { if (_fd >= 0) close_dir(_fd); }
+
+	trash_bin(const trash_bin &) = delete;
+	trash_bin &operator=(const trash_bin &) = delete;
+
+	// move parent_fd/name into the trash.  sets errno on failure.
+	bool put(int parent_fd, const char *name, const std::string &display) {
+		int fd = open();
+		if (fd < 0) return false;
+
+		char target[64];
+		for (unsigned tries = 0; tries < 16; ++tries) {
+			snprintf(target, sizeof(target), "%ld.%lu", (long)getpid(), _next++);
+			if (renameat(parent_fd, name, fd, target) == 0) {
+				if (_v) fprintf(stdout, "Moving %s to %s/%s\n", display.c_str(), _path.c_str(), target);
+				return true;
+			}
+			// left over from an earlier run.
+			if (errno != EEXIST && errno != ENOTEMPTY) return false;
+		}
+		return false;
+	}
+
+	const std::string &path() const { return _path; }
+
+private:
+
+	// created on first use; a failure is reported once.
+	int open() {
+		std::lock_guard<std::mutex> lk(_mutex);
+		if (_fd >= 0 || _failed) {
+			if (_fd < 0) errno = EXDEV;
+			return _fd;
+		}
+		if (mkdir(_path.c_str(), 0700) < 0 && errno != EEXIST) {
+			warn("%s", _path.c_str());
+		} else {
+			_fd = openat(AT_FDCWD, _path.c_str(), O_RDONLY | O_DIRECTORY);
+			if (_fd < 0) warn("%s", _path.c_str());
+		}
+		_failed = _fd < 0;
+		if (_failed) errno = EXDEV;
+		return _fd;
+	}
+
+	std::string _path;
+	std::mutex _mutex;
+	int _fd = -1;
+	bool _failed = false;
+	std::atomic<unsigned long> _next{0};
+};
+
+/*
+ * an .AppleDouble folder bound for the trash.  its sidecars aren't deleted
+ * one by one; merged ones are noted in case the folder has to stay.
+ */
+struct trash_state {
+	trash_bin *bin;
+	std::mutex lock;
+	std::vector<uint32_t> merged;
+	std::atomic<bool> keep{false}; // something in it isn't being deleted.
+
+	explicit trash_state(trash_bin *bin) : bin(bin) {}
+
+	void add(uint32_t name, bool rm) {
+		if (!rm) {
+			keep = true;
+			return;
+		}
+		std::lock_guard<std::mutex> lk(lock);
+		merged.push_back(name);
+	}
+};
+
+/*
+ * --journal: a record of progress, so an interrupted run (--deadline, a
+ * kill, a reboot) can be picked up with --resume instead of starting over.
+ *
+ *     D path/    path and everything under it are done
+ *     U n path   path is about to be unlinked (its merge is done), in batch n
+ *     C n        batch n's unlinks have been done (or failed)
+ *
+ * paths are as given on the command line, so a resume has to be run from
+ * the same directory; a newline or backslash in one is escaped.  records
+ * are appended with one write() each, so a crash leaves at most a partial
+ * last line, which is ignored.  the journal is compacted -- records under
+ * a finished directory dropped -- when a resume loads it, when it's grown
+ * enough since the last time, and at the end.
+ *
+ * a resume skips finished directories and first unlinks the sidecars whose
+ * batch hadn't finished -- only those, since a sidecar may have been put
+ * back since (with --durable, a U record is only written after the sync).
+ * everything else is walked again.
+ */
+const char *journal_magic = "dot_clean journal 2\n";
+
+class journal {
+public:
+	~journal() { close(); }
+
+	// exits if path exists and isn't a journal.
+	void open(const std::string &path, bool resume);
+	void close();
+
+	bool is_open() const { return _fd >= 0; }
+
+	// from the journal being resumed.
+	bool resuming() const { return !_finished.empty(); }
+	bool finished(const std::string &dir) const { return _finished.count(dir); }
+
+	void finish(const std::string &dir);
+
+	// returns the batch, for unlinked().
+	unsigned long unlinking(const std::string &dir, const std::vector<const char *> &names);
+	void unlinked(unsigned long batch);
+
+private:
+
+	struct state {
+		std::unordered_set<std::string> finished;
+		std::vector<std::pair<unsigned long, std::string>> pending;
+	};
+
+	static void escape(std::string &out, const char *cp);
+	static bool read(const std::string &path, state &st);
+	bool write(const state &st);
+	bool append(const std::string &records);
+	void compact();
+
+	std::string _path;
+	std::mutex _mutex;
+	int _fd = -1;
+	off_t _size = 0;
+	off_t _compact_at = 0;
+	std::unordered_set<std::string> _finished;
+	std::atomic<unsigned long> _batch{0};
+};
+
+journal _journal;
+
+void journal::escape(std::string &out, const char *cp) {
+	for (; *cp; ++cp) {
+		if (*cp == '\\') out += "\\\\";
+		else if (*cp == '\n') out += "\\n";
+		else out.push_back(*cp);
+	}
+}
+
+/*
+ * the journal, compacted: finished directories that aren't inside another
+ * one, and unlinks from unfinished batches that aren't inside any.
+ */
+bool journal::read(const std::string &path, state &st) {
+
+	FILE *fp = fopen(path.c_str(), "rb");
+	if (!fp) return errno == ENOENT;
+	auto close_fp = defer([fp]{ fclose(fp); });
+
+	std::string line;
+	std::vector<std::string> finished;
+	std::vector<std::pair<unsigned long, std::string>> pending;
+	std::unordered_set<unsigned long> completed;
+	bool header = true;
+	int c;
+	while ((c = getc(fp)) != EOF) {
+		if (c != '\n') {
+			line.push_back(c);
+			continue;
+		}
+		if (header) {
+			if (line + '\n' != journal_magic) break;
+			header = false;
+			line.clear();
+			continue;
+		}
+
+		// U and C start with the batch.
+		unsigned long batch = 0;
+		size_t start = 2;
+		if (line.compare(0, 2, "U ") == 0 || line.compare(0, 2, "C ") == 0) {
+			char *end;
+			batch = strtoul(line.c_str() + 2, &end, 10);
+			start = end - line.c_str();
+			if (*end == ' ') ++start;
+		}
+
+		std::string p;
+		for (size_t i = start; i < line.size(); ++i) {
+			if (line[i] == '\\' && i + 1 < line.size()) {
+				++i;
+				p.push_back(line[i] == 'n' ? '\n' : line[i]);
+			} else p.push_back(line[i]);
+		}
+		if (line.compare(0, 2, "D ") == 0) finished.push_back(std::move(p));
+		else if (line.compare(0, 2, "U ") == 0) pending.emplace_back(batch, std::move(p));
+		else if (line.compare(0, 2, "C ") == 0) completed.insert(batch);
+		line.clear();
+	}
+	if (ferror(fp)) return false;
+	// empty is fine -- a crash before the header was written.
+	if (header && (line.size() || ftell(fp))) {
+		errno = EINVAL;
+		return false;
+	}
+
+	std::unordered_set<std::string> all(finished.begin(), finished.end());
+	auto covered = [&all](const std::string &p, size_t end){
+		for (size_t i = p.find('/'); i < end; i = p.find('/', i + 1)) {
+			if (all.count(p.substr(0, i + 1))) return true;
+		}
+		return false;
+	};
+
+	st.finished.clear();
+	st.pending.clear();
+	for (auto &p : finished) {
+		if (!covered(p, p.size() - 1)) st.finished.insert(p);
+	}
+	for (auto &p : pending) {
+		if (!completed.count(p.first) && !covered(p.second, p.second.size())) st.pending.push_back(std::move(p));
+	}
+	return true;
+}
+
+// replaces the journal with st, and reopens it for appending.
+bool journal::write(const state &st) {
+
+	std::string records = journal_magic;
+	for (auto &p : st.finished) {
+		records += "D ";
+		escape(records, p.c_str());
+		records += '\n';
+	}
+	for (auto &p : st.pending) {
+		records += "U ";
+		records += std::to_string(p.first);
+		records += ' ';
+		escape(records, p.second.c_str());
+		records += '\n';
+	}
+
+	std::string tmp = _path + ".tmp";
+	int fd = ::open(tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_BINARY, 0666);
+	if (fd < 0) return false;
+	bool ok = (size_t)::write(fd, records.data(), records.size()) == records.size();
+	#ifndef _WIN32
+	if (ok) ok = fsync(fd) == 0;
+	#else
+	if (ok) remove(_path.c_str());
+	#endif
+	::close(fd);
+	if (ok) ok = rename(tmp.c_str(), _path.c_str()) == 0;
+	if (!ok) {
+		int e = errno;
+		unlink(tmp.c_str());
+		errno = e;
+		return false;
+	}
+
+	if (_fd >= 0) ::close(_fd);
+	_fd = ::open(_path.c_str(), O_WRONLY | O_APPEND | O_BINARY);
+	_size = records.size();
+	_compact_at = std::max<off_t>(16 << 20, 2 * _size);
+	return _fd >= 0;
+}
+
+void journal::open(const std::string &path, bool resume) {
+
+	_path = path;
+	state st;
+	if (!read(path, st)) {
+		if (errno == EINVAL) errx(EX_DATAERR, "%s: not a dot_clean journal", path.c_str());
+		err(EX_NOINPUT, "%s", path.c_str());
+	}
+
+	if (!resume) {
+		st.finished.clear();
+		st.pending.clear();
+	}
+
+	// one that can't go is merged again when its directory is walked.
+	for (auto &p : st.pending) {
+		const char *path = p.second.c_str();
+		if (_v) fprintf(stdout, "Deleting %s\n", path);
+		if (unlink(path) < 0 && errno != ENOENT) {
+			warn("unlink %s", path);
+			_rv = 1;
+		}
+	}
+	st.pending.clear();
+
+	if (!write(st)) err(EX_CANTCREAT, "%s", path.c_str());
+	_finished = std::move(st.finished);
+}
+
+void journal::close() {
+	if (_fd < 0) return;
+	compact();
+	if (_fd >= 0) ::close(_fd);
+	_fd = -1;
+}
+
+// with _mutex held (or no one else left to write).
+void journal::compact() {
+	state st;
+	if (read(_path, st) && write(st)) return;
+	warn("%s", _path.c_str());
+	_compact_at *= 2;
+}
+
+bool journal::append(const std::string &records) {
+	std::lock_guard<std::mutex> lk(_mutex);
+	if (_fd < 0) return false;
+	if ((size_t)::write(_fd, records.data(), records.size()) != records.size()) {
+		warn("%s", _path.c_str());
+		::close(_fd);
+		_fd = -1;
+		return false;
+	}
+	_size += records.size();
+	if (_size >= _compact_at) compact();
+	return true;
+}
+
+void journal::finish(const std::string &dir) {
+	std::string records = "D ";
+	escape(records, dir.c_str());
+	records += '\n';
+	append(records);
+}
+
+unsigned long journal::unlinking(const std::string &dir, const std::vector<const char *> &names) {
+	unsigned long batch = ++_batch;
+	std::string records;
+	std::string prefix = "U " + std::to_string(batch) + ' ';
+	escape(prefix, dir.c_str());
+	for (const char *name : names) {
+		records += prefix;
+		escape(records, name);
+		records += '\n';
+	}
+	append(records);
+	return batch;
+}
+
+void journal::unlinked(unsigned long batch) {
+	append("C " + std::to_string(batch) + '\n');
+}
+
+/*
+ * --index: new sidecars can only appear in a directory whose mtime has
+ * changed, so a directory that hasn't changed since the last run doesn't
+ * need to be read again -- only its subdirectories visited, and those are
+ * kept in the index too.
+ *
+ * a record per directory cleaned without errors, keyed by (st_dev, st_ino),
+ * with its mtime and ctime as they were when it was done (after its own
+ * deletions) and its .AppleDouble folder's, if it kept one.  the file is
+ * the sorted records and then the names, mapped and binary searched; it's
+ * a cache for this machine, so it's in native byte order, and a bad one is
+ * ignored.  a sidecar rewritten in place doesn't change its directory, so
+ * isn't noticed.
+ */
+int64_t nanoseconds(const struct stat &st, bool change) {
+	#if defined(__APPLE__)
+	const struct timespec &ts = change ? st.st_ctimespec : st.st_mtimespec;
+	#elif defined(_WIN32)
+	struct timespec ts = { change ? st.st_ctime : st.st_mtime, 0 };
+	#else
+	const struct timespec &ts = change ? st.st_ctim : st.st_mtim;
+	#endif
+	return (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+class dir_index {
+public:
+
+	struct record {
+		uint64_t dev;
+		uint64_t ino;
+		int64_t mtime;
+		int64_t ctime;
+		int64_t ad_mtime; // 0 if there's no .AppleDouble folder.
+		int64_t ad_ctime;
+		uint64_t names; // subdirectory names, each nul terminated.
+		uint64_t names_size;
+	};
+
+	void open(const std::string &path);
+	void save(bool keep_unseen);
+	bool is_open() const { return !_path.empty(); }
+
+	// the record, if the open directory fd (st from fstat) is as it was.
+	const record *unchanged(int fd, const struct stat &st) const;
+	const char *names(const record &r) const { return _names + r.names; }
+
+	// a directory that was done (with its names), or that wasn't.
+	void add(const record &r, const char *names);
+	void add_failed(uint64_t dev, uint64_t ino);
+
+	std::atomic<unsigned> unchanged_dirs{0};
+
+private:
+
+	struct header {
+		char magic[8];
+		uint64_t flags; // index_flags() of the run that wrote it.
+		uint64_t count;
+		uint64_t names_size;
+	};
+
+	static bool less(const record &a, const record &b) {
+		return a.dev != b.dev ? a.dev < b.dev : a.ino < b.ino;
+	}
+
+	std::string _path;
+	mapped_file _file;
+	const record *_records = nullptr;
+	size_t _count = 0;
+	const char *_names = nullptr;
+
+	std::mutex _mutex;
+	std::vector<record> _new;
+	std::string _new_names;
+	std::vector<record> _failed; // keys only.
+};
+
+const char dir_index_magic[8] = { 'd', 'c', 'i', 'n', 'd', 'e', 'x', '2' };
+
+/*
+ * the options that change what's left in a directory.  one done with -p
+ * still has its sidecars, say, so it isn't done for a run without it.
+ */
+uint64_t index_flags() {
+	return (_p ? 1 : 0) | (_n ? 2 : 0) | (_d ? 4 : 0) | (_f ? 8 : 0)
+		| (_u ? 16 : 0) | (_skip_identical ? 32 : 0) | (_m ? 64 : 0) | (_s ? 128 : 0);
+}
+
+dir_index _index;
+
+void dir_index::open(const std::string &path) {
+
+	_path = path;
+
+	std::error_code ec;
+	_file.open(path, mapped_file::readonly, ec);
+	if (ec) {
+		if (ec.value() != ENOENT) warnx("%s: %s (ignored)", path.c_str(), ec.message().c_str());
+		return;
+	}
+
+	const unsigned char *data = _file.data();
+	size_t size = _file.size();
+	header h;
+	if (size < sizeof(h)) return;
+	memcpy(&h, data, sizeof(h));
+	bool ok = !memcmp(h.magic, dir_index_magic, sizeof(h.magic))
+		&& h.count <= (size - sizeof(h)) / sizeof(record)
+		&& h.names_size == size - sizeof(h) - h.count * sizeof(record);
+
+	const record *records = (const record *)(data + sizeof(h));
+	const char *names = (const char *)(records + h.count);
+	for (size_t i = 0; ok && i < h.count; ++i) {
+		const record &r = records[i];
+		ok = r.names <= h.names_size && r.names_size <= h.names_size - r.names
+			&& (r.names_size == 0 || names[r.names + r.names_size - 1] == 0)
+			&& (i == 0 || less(records[i - 1], r));
+	}
+	if (!ok) {
+		warnx("%s: not a dot_clean index (ignored)", path.c_str());
+		_file.close();
+		return;
+	}
+	if (h.flags != index_flags()) {
+		if (_v) fprintf(stdout, "%s: written with other options (ignored)\n", path.c_str());
+		_file.close();
+		return;
+	}
+
+	_records = records;
+	_count = h.count;
+	_names = names;
+}
+
+const dir_index::record *dir_index::unchanged(int fd, const struct stat &st) const {
+
+	if (!_count) return nullptr;
+
+	record key = {};
+	key.dev = st.st_dev;
+	key.ino = st.st_ino;
+	auto iter = std::lower_bound(_records, _records + _count, key, less);
+	if (iter == _records + _count || less(key, *iter)) return nullptr;
+
+	if (iter->mtime != nanoseconds(st, false) || iter->ctime != nanoseconds(st, true)) return nullptr;
+	if (iter->ad_mtime) {
+		struct stat ad;
+		if (fstatat(fd, ".AppleDouble", &ad, AT_SYMLINK_NOFOLLOW) < 0) return nullptr;
+		if (iter->ad_mtime != nanoseconds(ad, false) || iter->ad_ctime != nanoseconds(ad, true)) return nullptr;
+	}
+	return iter;
+}
+
+void dir_index::add(const record &r, const char *names) {
+	std::lock_guard<std::mutex> lk(_mutex);
+	_new.push_back(r);
+	_new.back().names = _new_names.size();
+	_new_names.append(names, r.names_size);
+}
+
+void dir_index::add_failed(uint64_t dev, uint64_t ino) {
+	record r = {};
+	r.dev = dev;
+	r.ino = ino;
+	std::lock_guard<std::mutex> lk(_mutex);
+	_failed.push_back(r);
+}
+
+/*
+ * replaces the index with this run's records.  a run that didn't get to
+ * everything (--deadline, --resume) keeps the old records it didn't visit;
+ * they're only trusted if the directory still matches anyway.  an index
+ * written with other options wasn't opened, so none of it is kept.
+ */
+void dir_index::save(bool keep_unseen) {
+
+	// a directory can be visited twice (overlapping command line paths).
+	std::sort(_new.begin(), _new.end(), less);
+	_new.erase(std::unique(_new.begin(), _new.end(), [](const record &a, const record &b){
+		return !less(a, b) && !less(b, a);
+	}), _new.end());
+	if (keep_unseen && _count) {
+		std::sort(_failed.begin(), _failed.end(), less);
+		size_t n = _new.size();
+		for (size_t i = 0; i < _count; ++i) {
+			const record &r = _records[i];
+			if (std::binary_search(_new.begin(), _new.begin() + n, r, less)) continue;
+			if (std::binary_search(_failed.begin(), _failed.end(), r, less)) continue;
+			_new.push_back(r);
+			_new.back().names = _new_names.size();
+			_new_names.append(_names + r.names, r.names_size);
+		}
+		std::inplace_merge(_new.begin(), _new.begin() + n, _new.end(), less);
+	}
+	_file.close();
+	_records = nullptr;
+	_count = 0;
+
+	header h;
+	memcpy(h.magic, dir_index_magic, sizeof(h.magic));
+	h.flags = index_flags();
+	h.count = _new.size();
+	h.names_size = _new_names.size();
+
+	std::string tmp = _path + ".tmp";
+	FILE *fp = fopen(tmp.c_str(), "wb");
+	bool ok = fp != nullptr;
+	if (ok) {
+		ok = fwrite(&h, sizeof(h), 1, fp) == 1
+			&& fwrite(_new.data(), sizeof(record), _new.size(), fp) == _new.size()
+			&& fwrite(_new_names.data(), 1, _new_names.size(), fp) == _new_names.size();
+		ok = fclose(fp) == 0 && ok;
+	}
+	#ifdef _WIN32
+	if (ok) remove(_path.c_str());
+	#endif
+	if (ok) ok = rename(tmp.c_str(), _path.c_str()) == 0;
+	if (!ok) {
+		warn("%s", _path.c_str());
+		unlink(tmp.c_str());
+	}
+}
+
+/*
+ * --watch: the sidecars that have just been written in a directory
+ * (._foo, foo_rsrc_, .AppleDouble/foo).
+ */
+struct watch_names {
+	std::unordered_set<std::string> names;
+	bool apple_double = false; // any in .AppleDouble/
+};
+
+// directory descriptors open, and merges / deletions holding one (dir_ref).
+std::atomic<unsigned> _open_dirs{0};
+std::atomic<unsigned> _job_pins{0};
+
+/*
+ * a directory.  files inside it are always accessed relative to fd; paths
+ * are only rebuilt for messages.
+ *
+ * fd is closed once the directory has been walked and nothing still needs
+ * it: queued subdirectories that haven't opened themselves yet, merges and
+ * deletions in the later pipeline stages (see dir_ref).  while a deep walk
+ * has it suspended, it may also be closed and reopened later (see walker).
+ *
+ * an .AppleDouble folder is removed at that point too, once the last of its
+ * sidecars has been merged and deleted (or moved to the trash whole, with
+ * --trash).
+ *
+ * the directory's listing goes at the same time; queued work refers to
+ * names in it rather than copying them.
+ */
+struct dir_node {
+	std::shared_ptr<dir_node> parent;
+	std::string name;
+	std::atomic<int> fd{-1};
+
+	// whatever still needs fd.
+	std::atomic<unsigned> pending{0};
+	std::atomic<bool> done{false};
+	std::atomic<bool> retired{false};
+	bool queued = false;
+
+	// .AppleDouble: keeps the parent's fd, rmdir()s itself when retired.
+	bool pins_parent = false;
+	bool remove = false;
+
+	// its ._foo and foo_rsrc_ merges wait for its .AppleDouble folder's.
+	std::atomic<bool> held{false};
+
+	// recorded before fd is closed early, to verify the reopen.
+	dev_t dev = 0;
+	ino_t ino = 0;
+
+	// --journal and --index: listed in full (or unchanged), and nothing in it
+	// -- or, for incomplete, under it -- left undone.
+	bool listed = false;
+	mutable std::atomic<bool> failed{false};
+	mutable std::atomic<bool> incomplete{false};
+	const dir_index::record *unchanged = nullptr;
+
+	// --index: its times from before it was listed, moved on by our own
+	// changes to it (see index_changing) but not by anyone else's; stale if
+	// one got in.  an .AppleDouble folder hands its over to its parent.
+	mutable int64_t seen_mtime = 0;
+	mutable int64_t seen_ctime = 0;
+	int64_t seen_ad_mtime = 0;
+	int64_t seen_ad_ctime = 0;
+	mutable bool stale = false;
+
+	// --watch: only these sidecars, and no subdirectories.
+	std::unique_ptr<watch_names> only;
+
+	std::unique_ptr<name_index> listing;
+
+	// --trash: on a command line directory, and on .AppleDouble folders in it.
+	std::shared_ptr<trash_bin> bin;
+	std::unique_ptr<trash_state> trash;
+
+	dir_node(std::shared_ptr<dir_node> parent, std::string name) :
+		parent(std::move(parent)), name(std::move(name))
+	{}
+
+	dir_node(const dir_node &) = delete;
+	dir_node &operator=(const dir_node &) = delete;
+
+	~dir_node();
+
+	// relative to the parent (or the current directory).  sets errno on failure.
+	bool open() {
+		int tmp = openat(parent_fd(), name.c_str(), O_RDONLY | O_DIRECTORY);
+		if (tmp < 0) return false;
+		adopt(tmp);
+		return true;
+	}
+
+	void adopt(int tmp) {
+		_open_dirs++;
+		fd = tmp;
+	}
+
+	void close_fd() {
+		int tmp = fd.exchange(-1);
+		if (tmp >= 0) {
+			close_dir(tmp);
+			_open_dirs--;
+		}
+	}
+
+	// the walker is done with it.
+	void finish() {
+		done = true;
+		if (pending == 0) retire();
+	}
+
+	// something that needed fd is done with it.
+	void release() {
+		if (--pending == 0 && done) retire();
+	}
+
+	void retire();
+
+	int parent_fd() const {
+		return parent ? parent->fd.load() : AT_FDCWD;
+	}
+
+	// as given on the command line / discovered.
+	std::string display() const {
+		return parent ? parent->path() + name : name;
+	}
+
+	// with a trailing '/'
+	std::string path() const {
+		std::string rv;
+		append_path(rv);
+		return rv;
+	}
+
+	// path(), without allocating once out has grown.
+	void append_path(std::string &out) const {
+		if (parent) parent->append_path(out);
+		out += name;
+		while (!out.empty() && out.back() == '/') out.pop_back();
+		out.push_back('/');
+	}
+};
+
+/*
+ * dir's path + name, in a buffer the caller keeps around.
+ */
+const char *join_path(std::string &buffer, const dir_node &dir, const char *name) {
+	buffer.clear();
+	dir.append_path(buffer);
+	buffer += name;
+	return buffer.c_str();
+}
+
+void unlink_files(const dir_node &dir, std::vector<const char *> &unlink_list);
+void index_listing(dir_node &dir);
+void index_changing(const dir_node &dir);
+void index_changed(const dir_node &dir);
+void index_directory(const dir_node &dir);
+void release_held(dir_node &dir);
+
+/*
+ * --durable: the merges written so far have to be on disk before the
+ * sidecars they came from go.  syncfs() does a whole filesystem in one
+ * call, so a batch of deletions costs one sync, not an fsync per file.
+ * elsewhere there's only sync(), and windows has neither (--durable is
+ * refused there).
+ */
+bool sync_filesystem(int fd) {
+	#if defined(__linux__)
+	return syncfs(fd) == 0;
+	#elif defined(_WIN32)
+	(void)fd;
+	errno = ENOSYS;
+	return false;
+	#else
+	(void)fd;
+	sync();
+	return true;
+	#endif
+}
+
+void dir_node::retire() {
+	if (retired.exchange(true)) return;
+
+	bool trashed = false;
+	if (trash && !trash->merged.empty() && _durable && !sync_filesystem(parent->fd)) {
+		warn("sync %s", path().c_str());
+		// nothing merged in it goes.
+		failed = true;
+		trash->keep = true;
+		trash->merged.clear();
+	}
+	if (trash) {
+		if (remove && !trash->keep) {
+			index_changing(*parent);
+			trashed = trash->bin->put(parent->fd, name.c_str(), display());
+			index_changed(*parent);
+			if (!trashed && errno != EXDEV) warn("rename %s", path().c_str());
+		}
+		if (!trashed && !trash->merged.empty()) {
+			std::vector<const char *> names;
+			for (uint32_t n : trash->merged) names.push_back(listing->name(n));
+			unlink_files(*this, names);
+		}
+	}
+
+	// an .AppleDouble folder is part of its parent.
+	if (pins_parent && failed) parent->failed = true;
+	if (_index.is_open()) index_directory(*this);
+
+	_listings.put(std::move(listing));
+	close_fd();
+	if (remove && !trashed) {
+		// try to delete it...
+		if (_v) fprintf(stdout, "Deleting %s\n", path().c_str());
+		index_changing(*parent);
+		int ok = unlinkat(parent->fd, name.c_str(), AT_REMOVEDIR);
+		index_changed(*parent);
+		// --watch only merges some of what's in it.
+		if (ok < 0 && !(errno == ENOTEMPTY && parent->only)) warn("rmdir %s", path().c_str());
+	}
+	if (pins_parent) {
+		release_held(*parent);
+		parent->release();
+	}
+}
+
+/*
+ * the last of a subtree to go -- anything under a directory holds it (as
+ * parent) -- so this is when the journal can say it's all done.
+ */
+dir_node::~dir_node() {
+	close_fd();
+	if (!_journal.is_open()) return;
+	if (!listed || !retired || failed || incomplete) {
+		if (parent) parent->incomplete = true;
+		return;
+	}
+	// an .AppleDouble folder is part of its parent.
+	if (!pins_parent) _journal.finish(path());
+}
+
+typedef std::shared_ptr<dir_node> dir_ptr;
+
+/*
+ * a directory some pending work still needs (the merge and delete stages
+ * run after the walker has moved on).
+ */
+class dir_ref {
+public:
+	dir_ref() = default;
+	explicit dir_ref(dir_ptr p) : _p(std::move(p)) {
+		if (_p) {
+			_p->pending++;
+			_job_pins++;
+		}
+	}
+	dir_ref(const dir_ref &rhs) : dir_ref(rhs._p) {}
+	dir_ref(dir_ref &&) = default;
+	dir_ref &operator=(dir_ref rhs) { std::swap(_p, rhs._p); return *this; }
+	~dir_ref() {
+		if (_p) {
+			_job_pins--;
+			_p->release();
+		}
+	}
+
+	dir_node &operator*() const { return *_p; }
+	dir_node *operator->() const { return _p.get(); }
+	dir_node *get() const { return _p.get(); }
+
+private:
+	dir_ptr _p;
+};
+
+/*
+ * work for the merge and delete stages.  names are offsets into the
+ * directory's listing, which the dir_ref keeps alive, so a job is a few
+ * words and never allocates.
+ *
+ * the data file's name is the same as the sidecar's (.AppleDouble/foo) or
+ * part of it (._foo, foo_rsrc_), so it's in rsrc_dir's listing too.
+ */
+struct merge_job {
+	dir_ref data_dir;
+	dir_ref rsrc_dir;
+	uint32_t rsrc = 0;
+	uint32_t data = 0;
+	uint32_t data_length = 0;
+	unsigned char data_type = DT_UNKNOWN;
+	bool flat = false;
+
+	const char *rsrc_name() const { return rsrc_dir->listing->name(rsrc); }
+};
+
+struct unlink_job {
+	dir_ref dir;
+	uint32_t name = 0;
+
+	unlink_job() = default;
+	unlink_job(dir_ref dir, uint32_t name) : dir(std::move(dir)), name(name) {}
+
+	const char *c_str() const { return dir->listing->name(name); }
+};
+
+/*
+ * merges that have to wait for others: a directory's ._foo (and foo_rsrc_)
+ * is merged after its .AppleDouble/foo, as it always was.  rather than the
+ * walker waiting for the .AppleDouble folder, they're set aside until it
+ * retires, then the merge workers pick them up.
+ */
+class held_merges {
+public:
+
+	void hold(dir_node &dir) {
+		_dirs++;
+		dir.held = true;
+	}
+
+	// false if dir isn't (or is no longer) held: merge it now.
+	bool add(dir_node &dir, merge_job &job) {
+		if (!dir.held) return false;
+		std::lock_guard<std::mutex> lk(_mutex);
+		if (!dir.held) return false;
+		_held[&dir].push_back(std::move(job));
+		return true;
+	}
+
+	void release(dir_node &dir) {
+		std::lock_guard<std::mutex> lk(_mutex);
+		if (!dir.held.exchange(false)) return;
+		auto iter = _held.find(&dir);
+		if (iter != _held.end()) {
+			for (auto &job : iter->second) _ready.push_back(std::move(job));
+			_held.erase(iter);
+			_any_ready = true;
+		}
+		_dirs--;
+	}
+
+	// released jobs, for a merge worker.
+	bool take(std::vector<merge_job> &out) {
+		if (!_any_ready) return false;
+		std::lock_guard<std::mutex> lk(_mutex);
+		out.swap(_ready);
+		_any_ready = false;
+		return !out.empty();
+	}
+
+	// nothing held or waiting to be taken.
+	bool empty() const { return _dirs == 0 && !_any_ready; }
+
+private:
+	std::mutex _mutex;
+	std::unordered_map<const dir_node *, std::vector<merge_job>> _held;
+	std::vector<merge_job> _ready;
+	std::atomic<unsigned> _dirs{0};
+	std::atomic<bool> _any_ready{false};
+};
+
+held_merges _held;
+
+void release_held(dir_node &dir) {
+	_held.release(dir);
+}
+
+/*
+ * a merge_job's data file name, nul terminated.  the front of a raw fork's
+ * name (foo of foo_rsrc_) is copied out; the others are used in place.
+ */
+class data_name {
+public:
+	data_name() = default;
+	explicit data_name(const merge_job &job) { assign(job); }
+
+	void assign(const merge_job &job) {
+		const char *cp = job.rsrc_dir->listing->name(job.data);
+		if (cp[job.data_length] == 0) {
+			_name = cp;
+			return;
+		}
+		_name = nullptr;
+		memcpy(_buffer, cp, job.data_length);
+		_buffer[job.data_length] = 0;
+	}
+
+	const char *c_str() const { return _name ? _name : _buffer; }
+
+private:
+	const char *_name = nullptr;
+	char _buffer[256]; // a raw fork's name is longer.
+};
+
+
+/*
+ * --skip-identical: a rerun over preserved (-p) sidecars rewrites the same
+ * forks every time, and each rewrite is a journal commit (and snapshot
+ * churn).  the fork already there is compared first and left alone if it
+ * matches.
+ */
+std::atomic<unsigned long long> _fork_bytes_written{0};
+std::atomic<unsigned long long> _fork_bytes_skipped{0};
+std::atomic<unsigned long long> _fork_bytes_verified{0};
+
+/*
+ * --verify: a write that was cut short (an xattr size limit, a full disk
+ * that didn't say so) would otherwise only show once the sidecar is gone.
+ * the fork is read back and its length and crc32c compared with the
+ * sidecar's entry; a mismatch fails the merge, which keeps the sidecar.
+ */
+typedef bool (*fork_checksum)(int, const std::string &, size_t &, uint32_t &, std::error_code &);
+
+bool verify_fork(fork_checksum checksum, int fd, const std::string &path, const void *data, size_t size, merge_error &err, const char *what) {
+	std::error_code ec;
+	size_t n;
+	uint32_t crc;
+	if (!checksum(fd, path, n, crc, ec)) return set_fork_error(err, ec, what);
+	if (n != size || crc != crc32c(0, data, size))
+		return set_error(err, sidecar_errc::not_verified);
+	_fork_bytes_verified += size;
+	return true;
+}
+
+bool update_resource_fork(int fd, const std::string &path, const void *data, size_t size, merge_error &err) {
+	std::error_code ec;
+	// a match is as good as a verified write.
+	if (_skip_identical && forks::same_resource_fork(fd, path, data, size)) {
+		_fork_bytes_skipped += size;
+		return true;
+	}
+	forks::write_resource_fork(fd, path, data, size, ec);
+	if (ec) return set_fork_error(err, ec, "resource_fork::write()");
+	_fork_bytes_written += size;
+	if (_verify) return verify_fork(forks::checksum_resource_fork, fd, path, data, size, err, "resource_fork::read()");
+	return true;
+}
+
+bool update_finder_info(int fd, const std::string &path, const void *data, merge_error &err) {
+	std::error_code ec;
+	if (_skip_identical && forks::same_finder_info(fd, path, data)) {
+		_fork_bytes_skipped += 32;
+		return true;
+	}
+	if (!forks::write_finder_info(fd, path, data, ec))
+		return set_fork_error(err, ec, "com.apple.FinderInfo");
+	_fork_bytes_written += 32;
+	if (_verify) return verify_fork(forks::checksum_finder_info, fd, path, data, 32, err, "com.apple.FinderInfo");
+	return true;
+}
+
+/*
+ * an apple double (v1 or v2) header, if buffer starts with one.
+ */
+bool check_version(const applefile_view &v, merge_error &err) {
+
+	if (v.magic() != APPLEDOUBLE_MAGIC)
+		return set_error(err, sidecar_errc::not_apple_double);
+
+	// v 2 is a super set of v1. v1 had type 7 for os-specific info, since split into
+	// separate entries.
+	if (v.version() != 0x00010000 && v.version() != 0x00020000)
+		return set_error(err, sidecar_errc::not_apple_double);
+
+	return true;
+}
+
+/*
+ * merge an apple double file (already in memory) into the open data file
+ * (data_path is for platforms that can only set forks by path).
+ */
+bool merge_apple_double(int data_fd, const std::string &data_path, const unsigned char *buffer, size_t size, merge_error &err) {
+
+	applefile_view v;
+
+	if (v.parse_header(buffer, size) != applefile_view::valid)
+		return set_error(err, sidecar_errc::not_apple_double);
+	if (!check_version(v, err)) return false;
+
+	// check for truncation before changing anything.
+	if (v.parse(buffer, size) != applefile_view::valid)
+		return set_error(err, sidecar_errc::truncated);
+
+	/* AS_DATA should not exist for apple double! */
+
+	if (auto e = v.find(AS_RESOURCE)) {
+		if (!update_resource_fork(data_fd, data_path, v.data(e), e.length(), err)) return false;
+	}
+
+	if (auto e = v.find(AS_PRODOSINFO)) {
+		if (e.length() != 8) fputs("Warning: Invalid ProDOS Info size.\n", stderr);
+		// fi.set_prodos_file_type(); ??? 
+	}
+
+	/* Apple now includes xattr w/ finder info */
+	if (auto e = v.find(AS_FINDERINFO)) {
+		if (e.length() < 32) {
+			fputs("Warning: Invalid Finder Info size.\n", stderr);
+		} else if (!update_finder_info(data_fd, data_path, v.data(e), err)) {
+			return false;
+		}
+	}
+	return true;
+}
+
+/*
+ * raw resource fork data.  an empty fork truncates the existing one.
+ */
+bool merge_flat(int data_fd, const std::string &data_path, const unsigned char *buffer, size_t size, merge_error &err) {
+
+	if (size == 0) {
+		// truncate any existing resource fork.
+		std::error_code ec;
+		if (!forks::remove_resource_fork(data_fd, data_path, ec))
+			return set_fork_error(err, ec, "resource_fork::remove()");
+		return true;
+	}
+
+	return update_resource_fork(data_fd, data_path, buffer, size, err);
+}
+
+/*
+ * data_type is the data file's d_type from the directory listing, or
+ * dt_missing if it isn't listed.  DT_UNKNOWN and DT_LNK (which might point
+ * to a directory) still need a stat.
+ */
+const unsigned char dt_missing = 0xff;
+
+bool needs_stat(unsigned char type) {
+	return type == DT_UNKNOWN || type == DT_LNK;
+}
+
+// returns false if the data file doesn't exist (or on error, with err set).
+bool resolve_data_type(const dir_node &dir, const char *data, unsigned char &type, merge_error &err) {
+
+	if (type == dt_missing) return false;
+	if (!needs_stat(type)) return true;
+
+	struct stat st;
+	if (fstatat(dir.fd, data, &st, 0) < 0) {
+		if (errno == ENOENT) return false;
+		return set_errno(err, "stat");
+	}
+	type = S_ISDIR(st.st_mode) ? DT_DIR : DT_REG;
+	return true;
+}
+
+/*
+ * --background: stay out of the way of whatever else the machine is doing.
+ * sidecars are opened O_NOATIME (which the kernel only allows on files we
+ * own, so otherwise they're opened normally) and dropped from the page
+ * cache once they've been read.  data files are only opened to write to.
+ */
+int open_sidecar(int dir_fd, const char *name) {
+	#ifdef O_NOATIME
+	if (_background) {
+		int fd = openat(dir_fd, name, O_RDONLY | O_BINARY | O_NOATIME);
+		if (fd >= 0 || errno != EPERM) return fd;
+	}
+	#endif
+	return openat(dir_fd, name, O_RDONLY | O_BINARY);
+}
+
+void close_sidecar(int fd) {
+	#ifdef POSIX_FADV_DONTNEED
+	if (_background) posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+	#endif
+	close(fd);
+}
+
+// the forks are set through this.  -1 if the data file has gone (or on
+// error, with err set).
+int open_data_file(const dir_node &dir, const char *data, merge_error &err) {
+	int fd = openat(dir.fd, data, O_RDONLY | O_BINARY);
+	if (fd < 0 && errno != ENOENT) set_errno(err, "open");
+	return fd;
+}
+
+/*
+ * a sidecar's contents.  most are a few KiB (a ._ file is usually 4 KiB), so
+ * up to read_max bytes are pread() into a buffer that each thread reuses;
+ * an mmap/munmap for every one of those would have the threads fighting
+ * over the address space.  bigger ones (resource forks, mostly) are mapped.
+ *
+ * the data is valid until the next sidecar_data on the same thread.
+ */
+const size_t read_max = 64 * 1024;
+
+/*
+ * caps the bytes mapped at once by all the merge workers (--max-mapped).
+ * a sidecar bigger than the whole budget is still mapped, on its own.
+ */
+class map_budget {
+public:
+	void acquire(size_t n) {
+		std::unique_lock<std::mutex> lk(_mutex);
+		_cv.wait(lk, [&]{ return _used == 0 || _used + n <= _max_mapped; });
+		_used += n;
+	}
+
+	void release(size_t n) {
+		std::lock_guard<std::mutex> lk(_mutex);
+		_used -= n;
+		_cv.notify_all();
+	}
+
+private:
+	std::mutex _mutex;
+	std::condition_variable _cv;
+	size_t _used = 0;
+};
+
+map_budget _mapped;
+
+class sidecar_data {
+public:
+	sidecar_data() = default;
+	~sidecar_data();
+
+	bool open(int fd, size_t size, merge_error &err);
+
+	sidecar_data(const sidecar_data &) = delete;
+	sidecar_data &operator=(const sidecar_data &) = delete;
+
+	const unsigned char *data() const { return _data; }
+	size_t size() const { return _size; }
+
+private:
+	mapped_file _mf;
+	size_t _budget = 0;
+	const unsigned char *_data = nullptr;
+	size_t _size = 0;
+};
+
+bool sidecar_data::open(int fd, size_t size, merge_error &err) {
+
+	if (size > read_max) {
+		std::error_code ec;
+		_mapped.acquire(size);
+		_mf.open(fd, mapped_file::readonly, size, ec);
+		if (ec) {
+			_mapped.release(size);
+			err.ec = ec;
+			err.what = "mmap";
+			err.kind = failed_io;
+			return false;
+		}
+		_budget = size;
+		_data = _mf.data();
+		_size = _mf.size();
+		#if defined(MADV_WILLNEED) && !defined(_WIN32)
+		// fault it in with big reads, not a page at a time.
+		madvise((void *)_data, _size, MADV_WILLNEED);
+		#endif
+		return true;
+	}
+
+	static thread_local std::unique_ptr<unsigned char[]> buffer;
+	if (!buffer) buffer.reset(new unsigned char[read_max]);
+
+	// it may have shrunk since the fstat.
+	while (_size < size) {
+		ssize_t n = pread(fd, buffer.get() + _size, size - _size, _size);
+		if (n < 0) {
+			if (errno == EINTR) continue;
+			return set_errno(err, "read");
+		}
+		if (n == 0) break;
+		_size += n;
+	}
+	_data = buffer.get();
+	return true;
+}
+
+sidecar_data::~sidecar_data() {
+	if (_budget) {
+		_mf.close();
+		_mapped.release(_budget);
+	}
+}
+
+/*
+ * check a big sidecar's header before mapping all of it.
+ */
+bool check_header(int fd, merge_error &err) {
+	unsigned char buffer[sizeof(ASHeader)];
+	applefile_view v;
+	ssize_t n = pread(fd, buffer, sizeof(buffer), 0);
+	if (n < 0) return set_errno(err, "read");
+	if (v.parse_header(buffer, n) != applefile_view::valid)
+		return set_error(err, sidecar_errc::not_apple_double);
+	return check_version(v, err);
+}
+
+/*
+ * the paths of a merge, for messages and for platforms that set forks by
+ * path.  each thread reuses the buffers.
+ */
+struct merge_paths {
+	const char *rsrc;
+	const std::string &data;
+	const dir_node &rsrc_dir;
+
+	merge_paths(const dir_node &rsrc_dir, const char *rsrc_file, const dir_node &data_dir, const char *data_file) :
+		rsrc(join_path(rsrc_buffer(), rsrc_dir, rsrc_file)),
+		data(data_buffer()),
+		rsrc_dir(rsrc_dir)
+	{
+		join_path(data_buffer(), data_dir, data_file);
+	}
+
+private:
+	static std::string &rsrc_buffer() { static thread_local std::string b; return b; }
+	static std::string &data_buffer() { static thread_local std::string b; return b; }
+};
+
+bool merge_failed(const char *rsrc_path, const merge_error &err) {
+	_rv = 1;
+	_failures[err.kind]++;
+	std::string message = err.ec.message();
+	if (err.what) fprintf(stderr, "Merging %s failed: %s: %s\n", rsrc_path, err.what, message.c_str());
+	else fprintf(stderr, "Merging %s failed: %s\n", rsrc_path, message.c_str());
+	return false;
+}
+
+// anything else (std::bad_alloc, really).
+bool merge_failed(const char *rsrc_path, const std::exception &ex) {
+	_rv = 1;
+	_failures[failed_other]++;
+	fprintf(stderr, "Merging %s failed: %s\n", rsrc_path, ex.what());
+	return false;
+}
+
+void report_failures() {
+	static const char *names[failure_kinds] = {
+		"not Apple Double", "truncated", "damaged", "I/O errors", "fork errors", "not verified", "other errors"
+	};
+
+	unsigned total = 0;
+	for (auto &n : _failures) total += n;
+	if (!total) return;
+
+	fprintf(stdout, "%u sidecar%s not merged:", total, total == 1 ? "" : "s");
+	const char *sep = " ";
+	for (int i = 0; i < failure_kinds; ++i) {
+		if (!_failures[i]) continue;
+		fprintf(stdout, "%s%u %s", sep, _failures[i].load(), names[i]);
+		sep = ", ";
+	}
+	fputc('\n', stdout);
+}
+
+/*
+ * -v: the pages the run brought into the page cache, from what it caused
+ * to be read from storage (/proc/self/io, linux), and its major faults.
+ */
+struct io_usage {
+	unsigned long long read_bytes = 0;
+	long major_faults = 0;
+	bool known = false;
+};
+
+io_usage current_io() {
+	io_usage rv;
+	#ifdef __linux__
+	FILE *fp = fopen("/proc/self/io", "r");
+	if (fp) {
+		char line[128];
+		while (fgets(line, sizeof(line), fp)) {
+			if (sscanf(line, "read_bytes: %llu", &rv.read_bytes) == 1) rv.known = true;
+		}
+		fclose(fp);
+	}
+	#endif
+	#ifndef _WIN32
+	struct rusage ru;
+	if (getrusage(RUSAGE_SELF, &ru) == 0) rv.major_faults = ru.ru_majflt;
+	#endif
+	return rv;
+}
+
+void report_forks() {
+	fprintf(stdout, "%llu fork bytes written, %llu unchanged and skipped",
+		_fork_bytes_written.load(), _fork_bytes_skipped.load());
+	if (_verify) fprintf(stdout, ", %llu verified", _fork_bytes_verified.load());
+	fputc('\n', stdout);
+}
+
+void report_io(const io_usage &start) {
+	io_usage now = current_io();
+	if (!now.known) return;
+
+	long page = 4096;
+	#ifdef _SC_PAGESIZE
+	if (sysconf(_SC_PAGESIZE) > 0) page = sysconf(_SC_PAGESIZE);
+	#endif
+	unsigned long long pages = (now.read_bytes - start.read_bytes + page - 1) / page;
+	long faults = now.major_faults - start.major_faults;
+	fprintf(stdout, "%llu page%s read from storage, %ld major fault%s\n",
+		pages, pages == 1 ? "" : "s", faults, faults == 1 ? "" : "s");
+}
+
+/*
+ * run a merge, which returns whether the sidecar should be deleted or sets
+ * err, and report it if it failed.
+ */
+template<class FX>
+bool merge_reported(const merge_paths &paths, FX fx) noexcept {
+	merge_error err;
+	try {
+		bool rm = fx(err);
+		if (!err) return rm;
+		paths.rsrc_dir.failed = true;
+		return merge_failed(paths.rsrc, err);
+	} catch (const std::exception &ex) {
+		paths.rsrc_dir.failed = true;
+		return merge_failed(paths.rsrc, ex);
+	}
+}
+
+/*
+ * resource is straight data (cadius, nulib2, etc)
+ *
+ * rsrc_fd is the sidecar if it's already open (it's closed here), or -1.
+ * returns true if the sidecar should be deleted.
+ */
+bool one_flat_file(const merge_job &job, int rsrc_fd) noexcept {
+
+	auto close_rsrc = defer([&rsrc_fd]{ if (rsrc_fd >= 0) close_sidecar(rsrc_fd); });
+
+	const dir_node &dir = *job.data_dir;
+	const char *rsrc = job.rsrc_name();
+	data_name data(job);
+	merge_paths paths(dir, rsrc, dir, data.c_str());
+
+	return merge_reported(paths, [&](merge_error &err){
+
+		struct stat rsrc_st;
+		unsigned char data_type = job.data_type;
+
+		if (_v) fprintf(stdout, "Merging %s & %s\n", paths.rsrc, paths.data.c_str());
+
+		if (!resolve_data_type(dir, data.c_str(), data_type, err)) return _n;
+
+		// don't try to do directories.
+		if (data_type == DT_DIR) return !_p;
+
+		if (rsrc_fd < 0) rsrc_fd = open_sidecar(dir.fd, rsrc);
+		if (rsrc_fd < 0) return set_errno(err, "open");
+		int rfd = rsrc_fd;
+
+		if (fstat(rfd, &rsrc_st) < 0) return set_errno(err, "stat");
+
+		sidecar_data sd;
+		if (!sd.open(rfd, rsrc_st.st_size, err)) return false;
+
+		// only now is there something to write.
+		int fd = open_data_file(dir, data.c_str(), err);
+		if (fd < 0) return _n;
+		auto close_fd = defer([fd]{ close(fd); });
+
+		if (!merge_flat(fd, paths.data, sd.data(), sd.size(), err)) return false;
+
+		return !_p;
+	});
+}
+
+/*
+ * same, for an apple double sidecar.
+ */
+bool one_file(const merge_job &job, int rsrc_fd) noexcept {
+
+	auto close_rsrc = defer([&rsrc_fd]{ if (rsrc_fd >= 0) close_sidecar(rsrc_fd); });
+
+	const dir_node &data_dir = *job.data_dir;
+	const dir_node &rsrc_dir = *job.rsrc_dir;
+	const char *rsrc = job.rsrc_name();
+	data_name data(job);
+	merge_paths paths(rsrc_dir, rsrc, data_dir, data.c_str());
+
+	return merge_reported(paths, [&](merge_error &err){
+
+		struct stat rsrc_st;
+		unsigned char data_type = job.data_type;
+
+		if (_v) fprintf(stdout, "Merging %s & %s\n", paths.rsrc, paths.data.c_str());
+
+		if (!resolve_data_type(data_dir, data.c_str(), data_type, err)) return _n;
+
+		// don't try to do directories.
+		if (data_type == DT_DIR) return !_p;
+
+		if (rsrc_fd < 0) rsrc_fd = open_sidecar(rsrc_dir.fd, rsrc);
+		if (rsrc_fd < 0) return set_errno(err, "open");
+		int rfd = rsrc_fd;
+
+		if (fstat(rfd, &rsrc_st) < 0) return set_errno(err, "stat");
+		if (rsrc_st.st_size == 0) return !_p;
+
+		if ((size_t)rsrc_st.st_size > read_max && !check_header(rfd, err)) return false;
+
+		sidecar_data sd;
+		if (!sd.open(rfd, rsrc_st.st_size, err)) return false;
+
+		// only now is there something to write.
+		int fd = open_data_file(data_dir, data.c_str(), err);
+		if (fd < 0) return _n;
+		auto close_fd = defer([fd]{ close(fd); });
+
+		if (!merge_apple_double(fd, paths.data, sd.data(), sd.size(), err)) return false;
+
+		return !_p;
+	});
+}
+
+#ifdef HAVE_IO_URING
+
+const unsigned uring_entries = 256;
+
+/*
+ * one ring per worker thread.  nullptr if -u wasn't given or the kernel
+ * can't do what we need, in which case the plain system calls are used.
+ */
+uring *thread_ring() {
+	static thread_local uring ring;
+	static thread_local bool tried = false;
+
+	if (!_u) return nullptr;
+	if (!tried) {
+		tried = true;
+		if (ring.init(uring_entries)) {
+			if (!ring.supports(IORING_OP_OPENAT) || !ring.supports(IORING_OP_STATX) || !ring.supports(IORING_OP_READ))
+				ring.close();
+		}
+		if (!ring && _v) fputs("io_uring unavailable, using system calls.\n", stdout);
+	}
+	return ring ? &ring : nullptr;
+}
+
+#endif
+
+
+/*
+ * sidecars a merge worker has taken but not merged yet: opened, with
+ * read-ahead started, so the disk (or server) is already fetching the next
+ * ones while this one's forks are written.
+ *
+ * the window starts small and doubles whenever a merge still took more
+ * than a millisecond (so it waited on I/O), up to --prefetch.  after a long
+ * run of quick merges it shrinks by one, giving back descriptors.
+ */
+class prefetch_window {
+public:
+	typedef std::chrono::steady_clock clock;
+
+	// one more slot than the window, for the job pushed before the oldest goes.
+	void reserve(unsigned max) {
+		_items.reset(new item[max + 1]);
+		_max = max;
+		_limit = std::min(max, 4u);
+	}
+
+	unsigned capacity() const { return _max; }
+	bool empty() const { return _count == 0; }
+	bool over() const { return _count > _limit; }
+
+	// opens the sidecar; it's fine if that fails (the merge will say why).
+	void push(merge_job &&job) {
+		item &it = _items[(_head + _count++) % (_max + 1)];
+		it.job = std::move(job);
+		it.fd = open_sidecar(it.job.rsrc_dir->fd, it.job.rsrc_name());
+		if (it.fd >= 0) read_ahead(it.fd);
+	}
+
+	// the oldest job and its sidecar (or -1).
+	merge_job pop(int &fd) {
+		item &it = _items[_head];
+		_head = (_head + 1) % (_max + 1);
+		--_count;
+		fd = it.fd;
+		return std::move(it.job);
+	}
+
+	void observe(clock::duration d) {
+		if (d >= std::chrono::microseconds(slow_merge_us)) {
+			_limit = std::min(_max, _limit * 2);
+			_quick = 0;
+		} else if (++_quick >= 4 * _limit) {
+			if (_limit > 1) --_limit;
+			_quick = 0;
+		}
+	}
+
+private:
+
+	static void read_ahead(int fd) {
+		#if defined(POSIX_FADV_WILLNEED)
+		posix_fadvise(fd, 0, 0, POSIX_FADV_WILLNEED);
+		#elif defined(F_RDADVISE)
+		struct radvisory ra = { 0, (int)read_max };
+		fcntl(fd, F_RDADVISE, &ra);
+		#endif
+	}
+
+	enum { slow_merge_us = 1000 };
+
+	struct item {
+		merge_job job;
+		int fd = -1;
+	};
+
+	std::unique_ptr<item[]> _items;
+	unsigned _max = 0;
+	unsigned _head = 0;
+	unsigned _count = 0;
+	unsigned _limit = 0;
+	unsigned _quick = 0;
+};
+
+/*
+ * a merge stage worker's sidecars.  with io_uring, the data file statx (if
+ * the listing didn't settle it), sidecar openat + statx and the sidecar read
+ * are issued for a whole batch at once and the merges (xattr writes) run
+ * once everything has landed.  without it, sidecars wait in a prefetch
+ * window (unless --prefetch 0), oldest merged first.
+ *
+ * sidecars that were merged (and so are to be deleted) collect in unlinks().
+ */
+class merge_batch {
+public:
+
+	merge_batch() {
+		#ifdef HAVE_IO_URING
+		_ring = thread_ring();
+		if (_ring) {
+			_items.reserve(batch_size);
+			return;
+		}
+		#endif
+		if (_prefetch) _window.reserve(_prefetch);
+	}
+
+	merge_batch(const merge_batch &) = delete;
+	merge_batch &operator=(const merge_batch &) = delete;
+
+	~merge_batch() { flush(); }
+
+	void add(merge_job &&job) {
+		#ifdef HAVE_IO_URING
+		if (_ring) {
+			_items.emplace_back();
+			static_cast<merge_job &>(_items.back()) = std::move(job);
+			if (_items.size() == batch_size || 2 * _items.size() >= _merge_fds) flush();
+			return;
+		}
+		#endif
+		if (!_window.capacity()) {
+			bool rm = job.flat ? one_flat_file(job, -1) : one_file(job, -1);
+			done(std::move(job.rsrc_dir), job.rsrc, rm);
+			return;
+		}
+		_window.push(std::move(job));
+		while (_window.over()) merge_next();
+	}
+
+	void flush() noexcept;
+
+	std::vector<unlink_job> &unlinks() { return _unlinks; }
+
+private:
+
+	void merge_next() noexcept {
+		int fd;
+		merge_job job = _window.pop(fd);
+		auto start = prefetch_window::clock::now();
+		bool rm = job.flat ? one_flat_file(job, fd) : one_file(job, fd);
+		_window.observe(prefetch_window::clock::now() - start);
+		done(std::move(job.rsrc_dir), job.rsrc, rm);
+	}
+
+	// a folder going to the trash keeps its sidecars for now.
+	void done(dir_ref &&dir, uint32_t name, bool rm) {
+		if (dir->trash) dir->trash->add(name, rm);
+		else if (rm) _unlinks.push_back(unlink_job{ std::move(dir), name });
+	}
+
+	std::vector<unlink_job> _unlinks;
+	prefetch_window _window;
+
+	#ifdef HAVE_IO_URING
+
+	// up to 4 requests per item in the first round, so usually one submission
+	// (a full ring is drained early).
+	static const unsigned batch_size = uring_entries / 4;
+
+	struct item : merge_job {
+		struct statx data_stx;
+		struct statx rsrc_stx;
+		int data_res = 0;
+		int rsrc_res = 0;
+		int rsrc_fd = -1; // or -errno
+		unsigned char *buffer = nullptr; // one of _buffers
+		int read_res = 0;
+		data_name data_file;
+	};
+
+	bool finish(item &it) noexcept;
+
+	uring *_ring = nullptr;
+	std::vector<item> _items;
+	std::vector<std::unique_ptr<unsigned char[]>> _buffers; // read_max each, kept.
+
+	#endif
+};
+
+#ifdef HAVE_IO_URING
+
+void merge_batch::flush() noexcept {
+
+	while (!_window.empty()) merge_next();
+	if (_items.empty()) return;
+
+	enum { data_statx, rsrc_openat, rsrc_statx, rsrc_read };
+
+	int noatime = 0;
+	#ifdef O_NOATIME
+	if (_background) noatime = O_NOATIME;
+	#endif
+
+	auto complete = [this](uint64_t user_data, int res){
+		auto &it = _items[user_data >> 3];
+		switch(user_data & 7) {
+			case data_statx: it.data_res = res; break;
+			case rsrc_openat: it.rsrc_fd = res; break;
+			case rsrc_statx: it.rsrc_res = res; break;
+			case rsrc_read: it.read_res = res; break;
+		}
+	};
+
+	// round 1: what is the data file, open the sidecar, how big is it.  the
+	// data file isn't opened until there's something to write.
+	for (unsigned i = 0; i < _items.size(); ++i) {
+		auto &it = _items[i];
+		io_uring_sqe *sqe;
+
+		it.data_file.assign(it);
+
+		if (needs_stat(it.data_type)) {
+			sqe = _ring->get_sqe(complete);
+			prep_statx(sqe, it.data_dir->fd, it.data_file.c_str(), 0, STATX_TYPE | STATX_MODE, &it.data_stx);
+			sqe->user_data = i << 3 | data_statx;
+		}
+
+		sqe = _ring->get_sqe(complete);
+		prep_openat(sqe, it.rsrc_dir->fd, it.rsrc_name(), O_RDONLY | O_BINARY | noatime);
+		sqe->user_data = i << 3 | rsrc_openat;
+
+		sqe = _ring->get_sqe(complete);
+		prep_statx(sqe, it.rsrc_dir->fd, it.rsrc_name(), 0, STATX_SIZE, &it.rsrc_stx);
+		sqe->user_data = i << 3 | rsrc_statx;
+	}
+	_ring->drain(complete);
+
+	for (auto &it : _items) {
+		// not our file, so no O_NOATIME.
+		if (it.rsrc_fd == -EPERM && noatime) {
+			it.rsrc_fd = openat(it.rsrc_dir->fd, it.rsrc_name(), O_RDONLY | O_BINARY);
+			if (it.rsrc_fd < 0) it.rsrc_fd = -errno;
+		}
+		if (!needs_stat(it.data_type)) continue;
+		if (it.data_res == -ENOENT) it.data_type = dt_missing;
+		else if (it.data_res == 0) it.data_type = S_ISDIR(it.data_stx.stx_mode) ? DT_DIR : DT_REG;
+	}
+
+	// round 2: read the small ones.
+	for (unsigned i = 0; i < _items.size(); ++i) {
+		auto &it = _items[i];
+		if (it.data_res < 0 || it.data_type == dt_missing || it.data_type == DT_DIR) continue;
+		if (it.rsrc_fd < 0 || it.rsrc_res < 0) continue;
+		size_t size = it.rsrc_stx.stx_size;
+		if (size == 0 || size > read_max) continue;
+
+		if (_buffers.size() <= i) _buffers.resize(i + 1);
+		if (!_buffers[i]) _buffers[i].reset(new unsigned char[read_max]);
+		it.buffer = _buffers[i].get();
+
+		io_uring_sqe *sqe = _ring->get_sqe(complete);
+		prep_read(sqe, it.rsrc_fd, it.buffer, size, 0);
+		sqe->user_data = i << 3 | rsrc_read;
+	}
+	_ring->drain(complete);
+
+	for (auto &it : _items) {
+		bool rm = finish(it);
+		done(std::move(it.rsrc_dir), it.rsrc, rm);
+		if (it.rsrc_fd >= 0) close_sidecar(it.rsrc_fd);
+	}
+	_items.clear();
+}
+
+/*
+ * same decisions (and messages) as one_file / one_flat_file, from the
+ * prefetched results.
+ */
+bool merge_batch::finish(item &it) noexcept {
+
+	merge_paths paths(*it.rsrc_dir, it.rsrc_name(), *it.data_dir, it.data_file.c_str());
+
+	return merge_reported(paths, [&](merge_error &err){
+
+		if (_v) fprintf(stdout, "Merging %s & %s\n", paths.rsrc, paths.data.c_str());
+
+		if (it.data_type == dt_missing) return _n;
+		if (it.data_res < 0) return set_errno(err, -it.data_res, "stat");
+
+		// don't try to do directories.
+		if (it.data_type == DT_DIR) return !_p;
+
+		if (it.rsrc_fd < 0) return set_errno(err, -it.rsrc_fd, "open");
+		if (it.rsrc_res < 0) return set_errno(err, -it.rsrc_res, "stat");
+
+		size_t size = it.rsrc_stx.stx_size;
+		if (size == 0 && !it.flat) return !_p;
+
+		const unsigned char *data = it.buffer;
+		sidecar_data sd;
+		if (size == 0) {
+			// truncates the resource fork.
+		} else if (it.buffer) {
+			if (it.read_res < 0) return set_errno(err, -it.read_res, "read");
+			size = it.read_res;
+		} else {
+			if (!it.flat && !check_header(it.rsrc_fd, err)) return false;
+			if (!sd.open(it.rsrc_fd, size, err)) return false;
+			data = sd.data();
+			size = sd.size();
+		}
+
+		// only now is there something to write.
+		int fd = open_data_file(*it.data_dir, it.data_file.c_str(), err);
+		if (fd < 0) return _n;
+		auto close_fd = defer([fd]{ close(fd); });
+
+		auto merge = it.flat ? merge_flat : merge_apple_double;
+		if (!merge(fd, paths.data, data, size, err)) return false;
+
+		return !_p;
+	});
+}
+
+#else
+
+uring *thread_ring() { return nullptr; }
+
+void merge_batch::flush() noexcept {
+	while (!_window.empty()) merge_next();
+}
+
+#endif
+
+/*
+ * the names are in dir's listing.
+ */
+void unlink_files(const dir_node &dir, std::vector<const char *> &unlink_list) {
+
+	// only built for messages (and the journal).
+	std::string path;
+	auto prefix = [&]() -> const char * {
+		if (path.empty()) dir.append_path(path);
+		return path.c_str();
+	};
+
+	// once they're done, a resume mustn't do them again.
+	unsigned long batch = _journal.is_open() ? _journal.unlinking(prefix(), unlink_list) : 0;
+	auto unlinked = defer([batch]{ if (batch) _journal.unlinked(batch); });
+	index_changing(dir);
+	auto changed = defer([&dir]{ index_changed(dir); });
+
+	#ifdef HAVE_IO_URING
+	uring *ring = thread_ring();
+	if (ring && ring->supports(IORING_OP_UNLINKAT)) {
+		static thread_local std::vector<int> results;
+		results.resize(unlink_list.size());
+
+		for (size_t i = 0; i < unlink_list.size(); ) {
+			size_t n = std::min<size_t>(unlink_list.size() - i, ring->capacity());
+			for (size_t j = i; j < i + n; ++j) {
+				io_uring_sqe *sqe = ring->get_sqe();
+				prep_unlinkat(sqe, dir.fd, unlink_list[j], 0);
+				sqe->user_data = j;
+			}
+			ring->drain([](uint64_t j, int res){ results[j] = res; });
+			i += n;
+		}
+
+		for (size_t i = 0; i < unlink_list.size(); ++i) {
+			const char *name = unlink_list[i];
+			if (_v) fprintf(stdout, "Deleting %s%s\n", prefix(), name);
+			if (results[i] < 0) {
+				prefix();
+				errno = -results[i];
+				warn("unlink %s%s", path.c_str(), name);
+				dir.failed = true;
+			}
+		}
+		unlink_list.clear();
+		return;
+	}
+	#endif
+
+	for (const char *name : unlink_list) {
+		if (_v) fprintf(stdout, "Deleting %s%s\n", prefix(), name);
+		int ok = unlinkat(dir.fd, name, 0);
+		if (ok < 0) {
+			int e = errno;
+			prefix();
+			errno = e;
+			warn("unlink %s%s", path.c_str(), name);
+			dir.failed = true;
+		}
+	}
+	unlink_list.clear();
+}
 
-#include "applefile.h"
-#include "mapped_file.h"
-#include "defer.h"
 
+/*
+ * the stages after the walk:
+ *
+ *   scan (walker, -j threads) -> merge (--merge-jobs) -> delete (--delete-jobs)
+ *
+ * joined by bounded lock-free queues, so a scanner only waits on the
+ * mergers when they're queue_size sidecars behind, and deletions drain in
+ * the background.  an idle worker backs off (yields, then short sleeps)
+ * rather than parking on a lock.
+ */
+const size_t queue_size = 4096;
+const size_t max_unlink = 256;
+const size_t max_unlink_dirs = 8;
 
-#ifndef O_BINARY
-#define O_BINARY 0
-#endif
+class pipeline {
+public:
+	pipeline(unsigned merge_jobs, unsigned delete_jobs);
+	~pipeline() { finish(); }
 
+	pipeline(const pipeline &) = delete;
+	pipeline &operator=(const pipeline &) = delete;
 
-std::vector<std::string> unlink_list;
+	// these wait while the queue is full.
+	void merge(merge_job &&job);
+	void unlink(unlink_job &&job);
 
+	// no more work is coming; wait for it all to drain.
+	void finish();
 
-bool _f = false;
-bool _m = false;
-bool _n = false;
-bool _p = false;
-bool _s = false;
-bool _d = false;
-unsigned _v = 0;
+	static void backoff(unsigned &spins);
 
-int _rv = 0;
+private:
 
+	void merge_worker();
+	void delete_worker();
 
+	mpmc_queue<merge_job> _merge_queue;
+	mpmc_queue<unlink_job> _unlink_queue;
+	std::atomic<bool> _merge_closed{false};
+	std::atomic<bool> _unlink_closed{false};
+	std::vector<std::thread> _mergers;
+	std::vector<std::thread> _deleters;
+};
 
+pipeline::pipeline(unsigned merge_jobs, unsigned delete_jobs) :
+	_merge_queue(queue_size), _unlink_queue(queue_size)
+{
+	for (unsigned i = 0; i < merge_jobs; ++i) _mergers.emplace_back([this]{ merge_worker(); });
+	for (unsigned i = 0; i < delete_jobs; ++i) _deleters.emplace_back([this]{ delete_worker(); });
+}
 
-void throw_damaged_file() {
-	throw std::runtime_error("File is damaged.");
+void pipeline::backoff(unsigned &spins) {
+	if (spins < 64) {
+		++spins;
+		std::this_thread::yield();
+		return;
+	}
+	// idle for a second or so (--watch, between bursts): stop waking up so often.
+	if (spins < 64 + 5000) {
+		++spins;
+		std::this_thread::sleep_for(std::chrono::microseconds(200));
+		return;
+	}
+	std::this_thread::sleep_for(std::chrono::milliseconds(10));
 }
 
-void throw_not_apple_double() {
-	throw std::runtime_error("Not an Apple Double File");
+void pipeline::merge(merge_job &&job) {
+	unsigned spins = 0;
+	while (!_merge_queue.try_push(std::move(job))) backoff(spins);
 }
 
-void throw_eof() {
-	throw std::runtime_error("Unexpected end of file.");
+void pipeline::unlink(unlink_job &&job) {
+	unsigned spins = 0;
+	while (!_unlink_queue.try_push(std::move(job))) backoff(spins);
 }
 
+void pipeline::finish() {
+	if (_merge_closed.exchange(true)) return;
+	for (auto &t : _mergers) t.join();
 
-void throw_errno() {
-	throw std::system_error(errno, std::generic_category());
+	// mergers are the last to queue deletions.
+	_unlink_closed = true;
+	for (auto &t : _deleters) t.join();
 }
 
+void pipeline::merge_worker() {
+
+	merge_batch batch;
+	merge_job job;
+	std::vector<merge_job> released;
+	unsigned spins = 0;
+
+	auto forward = [&]{
+		for (auto &u : batch.unlinks()) unlink(std::move(u));
+		batch.unlinks().clear();
+	};
+
+	for(;;) {
+		if (_held.take(released)) {
+			for (auto &j : released) {
+				batch.add(std::move(j));
+				forward();
+			}
+			released.clear();
+			spins = 0;
+			continue;
+		}
+
+		if (_merge_queue.try_pop(job)) {
+			batch.add(std::move(job));
+			job = merge_job();
+			forward();
+			spins = 0;
+			continue;
+		}
 
-void throw_errno(const std::string &what) {
-	throw std::system_error(errno, std::generic_category(), what);
+		// nothing waiting: don't sit on a partial batch.
+		batch.flush();
+		forward();
+		// an .AppleDouble folder still being cleaned can release more.
+		if (_merge_closed && _merge_queue.empty() && _held.empty()) break;
+		backoff(spins);
+	}
 }
 
-void throw_ec(const std::error_code &ec) {
-	throw std::system_error(ec);
+/*
+ * deletions are gathered per directory, a few directories at a time (the
+ * merge workers interleave theirs on the queue), and each directory's are
+ * unlinked together -- one io_uring batch with -u.  a batch holds its
+ * dir_ref, so an .AppleDouble folder's rmdir() still waits for the last of
+ * its sidecars to go.
+ */
+void pipeline::delete_worker() {
+
+	struct batch {
+		dir_ref dir;
+		std::vector<const char *> names;
+	};
+
+	unlink_job job;
+	// [0, open) are in use; the rest keep their capacity for reuse.
+	batch batches[max_unlink_dirs];
+	size_t open = 0;
+	unsigned spins = 0;
+
+	auto unlink_batch = [&](size_t i){
+		unlink_files(*batches[i].dir, batches[i].names);
+		batches[i].dir = dir_ref();
+		std::swap(batches[i], batches[--open]);
+	};
+
+	// --durable: one sync per filesystem for everything waiting, then it all
+	// goes.  if a sync fails, that filesystem's sidecars stay.
+	auto flush_all = [&]{
+		if (_durable) {
+			dev_t synced[max_unlink_dirs];
+			size_t n = 0;
+			for (size_t i = 0; i < open; ) {
+				batch &b = batches[i];
+				struct stat st;
+				bool ok = fstat(b.dir->fd, &st) == 0;
+				if (ok && std::find(synced, synced + n, st.st_dev) == synced + n) {
+					ok = sync_filesystem(b.dir->fd);
+					if (ok) synced[n++] = st.st_dev;
+				}
+				if (ok) {
+					++i;
+					continue;
+				}
+				warn("sync %s", b.dir->path().c_str());
+				_rv = 1;
+				b.dir->failed = true;
+				b.names.clear();
+				b.dir = dir_ref();
+				std::swap(b, batches[--open]);
+			}
+		}
+		while (open) unlink_batch(open - 1);
+	};
+
+	auto flush = [&](size_t i){
+		if (_durable) flush_all();
+		else unlink_batch(i);
+	};
+
+	auto largest = [&]{
+		size_t rv = 0;
+		for (size_t i = 1; i < open; ++i)
+			if (batches[i].names.size() > batches[rv].names.size()) rv = i;
+		return rv;
+	};
+
+	for(;;) {
+		if (_unlink_queue.try_pop(job)) {
+			const char *name = job.c_str();
+			size_t i = 0;
+			while (i < open && batches[i].dir.get() != job.dir.get()) ++i;
+			if (i == open) {
+				if (open == max_unlink_dirs) flush(largest());
+				i = open++;
+				batches[i].dir = std::move(job.dir);
+			}
+			batches[i].names.push_back(name);
+			job = unlink_job();
+			if (batches[i].names.size() >= max_unlink) flush(i);
+			spins = 0;
+			continue;
+		}
+
+		flush_all();
+		if (_unlink_closed && _unlink_queue.empty()) break;
+		backoff(spins);
+	}
 }
 
-void throw_ec(const std::error_code &ec, const std::string &what) {
-	throw std::system_error(ec, what);
+
+/*
+ * what a directory entry is, judged by its name alone (no allocation).
+ */
+enum name_kind {
+	name_plain,        // possibly a subdirectory
+	name_hidden,
+	name_ds_store,     // .DS_Store or ._.DS_Store, with -d
+	name_apple_double, // ._foo
+	name_raw_fork,     // foo_rsrc_ or foo_ResourceFork.bin
+};
+
+struct name_class {
+	name_kind kind;
+	size_t data_offset; // the data file's name within the entry's.
+	size_t data_length;
+};
+
+/* "_ResourceFork.bin" is '_' + 16 bytes, which is exactly one vector. */
+static bool ends_with_resource_fork_bin(const char *name, size_t length) {
+	const char *p = name + length - 16;
+	if (p[-1] != '_') return false;
+#if defined(__SSE2__)
+	__m128i a = _mm_loadu_si128((const __m128i *)p);
+	__m128i b = _mm_loadu_si128((const __m128i *)"ResourceFork.bin");
+	return _mm_movemask_epi8(_mm_cmpeq_epi8(a, b)) == 0xffff;
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+	uint8x16_t eq = vceqq_u8(vld1q_u8((const uint8_t *)p), vld1q_u8((const uint8_t *)"ResourceFork.bin"));
+	return vminvq_u8(eq) == 0xff;
+#else
+	return !memcmp(p, "ResourceFork.bin", 16);
+#endif
 }
 
+name_class classify_name(const char *name, size_t length) {
+
+	if (name[0] == '.') {
+		if (_d) {
+			if (length == 9 && !memcmp(name, ".DS_Store", 9)) return { name_ds_store, 0, 0 };
+			if (length == 11 && !memcmp(name, "._.DS_Store", 11)) return { name_ds_store, 0, 0 };
+		}
+		if (length > 2 && name[1] == '_') return { name_apple_double, 2, length - 2 };
+	}
+
+	/* _ResourceFork.bin or _rsrc_ raw resource data. */
+	if (length > 17 && ends_with_resource_fork_bin(name, length))
+		return { name_raw_fork, 0, length - 17 };
+
+	if (length > 6 && !memcmp(name + length - 6, "_rsrc_", 6))
+		return { name_raw_fork, 0, length - 6 };
+
+	if (name[0] == '.') return { name_hidden, 0, 0 };
+	return { name_plain, 0, length };
+}
 
+// only plain names might be recursed into, so only they need a d_type.
+static bool need_type(const char *name, size_t length) {
+	return !_f && classify_name(name, length).kind == name_plain;
+}
 
 /*
- * resource is straight data (cadius, nulib2, etc)
+ * --index: a directory is only recorded if nobody else has changed it
+ * since it was listed -- something that turned up in the meantime (a new
+ * sidecar, say) wasn't seen, and a later run would skip it.  so the times
+ * are taken before the listing, and our own changes (deleting sidecars,
+ * removing the .AppleDouble folder) go between index_changing() and
+ * index_changed(), which move them on.  one that finds the times have
+ * moved already marks the directory stale.
  */
-void one_flat_file(const std::string &data, const std::string rsrc) noexcept try {
+std::mutex _seen_mutex;
+
+void index_listing(dir_node &dir) {
+	struct stat st;
+	if (fstat(dir.fd, &st) < 0) {
+		dir.stale = true;
+		return;
+	}
+	dir.seen_mtime = nanoseconds(st, false);
+	dir.seen_ctime = nanoseconds(st, true);
+	if (!dir.pins_parent) dir.unchanged = _index.unchanged(dir.fd, st);
+}
 
-	struct stat rsrc_st;
-	int ok;
+void index_changing(const dir_node &dir) {
+	if (!_index.is_open()) return;
+	struct stat st;
+	bool ok = fstat(dir.fd, &st) == 0;
+	std::lock_guard<std::mutex> lk(_seen_mutex);
+	if (!ok || nanoseconds(st, false) != dir.seen_mtime || nanoseconds(st, true) != dir.seen_ctime)
+		dir.stale = true;
+}
 
-	if (_v) fprintf(stdout, "Merging %s & %s\n", rsrc.c_str(), data.c_str());
+void index_changed(const dir_node &dir) {
+	if (!_index.is_open()) return;
+	struct stat st;
+	bool ok = fstat(dir.fd, &st) == 0;
+	std::lock_guard<std::mutex> lk(_seen_mutex);
+	if (!ok) {
+		dir.stale = true;
+		return;
+	}
+	dir.seen_mtime = nanoseconds(st, false);
+	dir.seen_ctime = nanoseconds(st, true);
+}
 
-	ok = stat(data.c_str(), &rsrc_st);
-	if (ok < 0) {
-		if (errno == ENOENT) {
-			if (_n) unlink_list.push_back(rsrc);
-			return;
-		}
-		throw_errno("stat");
+/*
+ * the record for a directory being retired (fd still open), with the
+ * subdirectories the walker would visit.
+ */
+void index_directory(const dir_node &dir) {
+
+	// an .AppleDouble folder's times are checked with its parent.
+	if (dir.pins_parent) {
+		std::lock_guard<std::mutex> lk(_seen_mutex);
+		dir.parent->seen_ad_mtime = dir.seen_mtime;
+		dir.parent->seen_ad_ctime = dir.seen_ctime;
+		if (dir.stale) dir.parent->stale = true;
+		return;
 	}
 
-	// don't try to do directories.
-	if (S_ISDIR(rsrc_st.st_mode)) {
-		if (!_p) unlink_list.push_back(rsrc);
+	struct stat st;
+	if (fstat(dir.fd, &st) < 0) return;
+	if (!dir.listed || dir.failed || dir.only) {
+		_index.add_failed(st.st_dev, st.st_ino);
+		return;
+	}
+	if (dir.unchanged) {
+		_index.add(*dir.unchanged, _index.names(*dir.unchanged));
 		return;
 	}
 
-	int fd = open(data.c_str(), O_RDONLY | O_BINARY);
-	if (fd < 0) {
-		if (errno == ENOENT) {
-			if (_n) unlink_list.push_back(rsrc);
-			return;
-		}
-		throw_errno("open");
+	dir_index::record r = {};
+	r.dev = st.st_dev;
+	r.ino = st.st_ino;
+	r.mtime = nanoseconds(st, false);
+	r.ctime = nanoseconds(st, true);
+	if (fstatat(dir.fd, ".AppleDouble", &st, AT_SYMLINK_NOFOLLOW) == 0) {
+		r.ad_mtime = nanoseconds(st, false);
+		r.ad_ctime = nanoseconds(st, true);
 	}
-	defer close_fd([fd]{close(fd); });
 
-	if (stat(rsrc.c_str(), &rsrc_st) < 0) throw_errno("stat");
+	bool same;
+	{
+		std::lock_guard<std::mutex> lk(_seen_mutex);
+		same = !dir.stale && r.mtime == dir.seen_mtime && r.ctime == dir.seen_ctime
+			&& (!r.ad_mtime || (r.ad_mtime == dir.seen_ad_mtime && r.ad_ctime == dir.seen_ad_ctime));
+	}
+	if (!same) {
+		_index.add_failed(r.dev, r.ino);
+		return;
+	}
+
+	static thread_local std::string names;
+	names.clear();
+	const name_index &index = *dir.listing;
+	for (const auto &e : index) {
+		const char *name = index.name(e);
+		if (e.type != DT_DIR || classify_name(name, e.length).kind != name_plain) continue;
+		names.append(name, e.length);
+		names.push_back(0);
+	}
+	r.names_size = names.size();
+	_index.add(r, names.data());
+}
+
+/*
+ * directory traversal.
+ *
+ * each directory is listed once, into a name index.  sidecars are paired
+ * with their data files through the index (so the data file is only
+ * stat()ed when the listing can't say whether it's a directory) and the
+ * .AppleDouble folder is only opened if it's listed.  the index stays with
+ * the dir_node until its queued work is done, since that work (and the
+ * walker's list of subdirectories still to visit) names files by their
+ * place in it; then it goes back to a pool for another directory.
+ *
+ * each worker walks depth first with an explicit stack of frames.  a
+ * subdirectory is either handed to the pool (while the shared queue is
+ * short and there's more than one job) or descended into right away.
+ * merges and deletions are queued for the later stages (see pipeline).
+ *
+ * a directory with more than chunk_size entries is split: the other
+ * chunks of its listing go to the pool, so several workers pair up
+ * its sidecars (and find its subdirectories) at once.  each chunk pins
+ * the directory, so its .AppleDouble folder and descriptor outlast them.
+ *
+ * peak memory:
+ *
+ *   per scan worker
+ *     - one frame (dir_node + name, ~150 bytes) per level of depth, plus
+ *       4 bytes for each subdirectory not yet visited (an offset into the
+ *       listing; the names aren't copied).
+ *     - the name index of each directory on the path: its names plus
+ *       ~40 bytes an entry (about 4 MiB for 100,000 entries).
+ *     - one 32 KiB directory buffer.
+ *     - at most max_open_dirs descriptors held by frames.  past that, the
+ *       shallowest idle ones are closed and reopened (and checked against
+ *       their dev/ino) when they're needed again.
+ *
+ *   per merge worker
+ *     - one 64 KiB sidecar buffer.
+ *     - the merge batch: 64 entries, plus up to 64 x 64 KiB of read buffers
+ *       (kept once used) with -u
+ *
+ *   per delete worker
+ *     - at most max_unlink names waiting to be deleted in each of
+ *       max_unlink_dirs directories, each pinning its descriptor.
+ *
+ *   shared
+ *     - about 2 x jobs queued subdirectories, each pinning its parent's
+ *       descriptor until it has been opened.
+ *     - the merge and delete queues, queue_size jobs (~50 bytes) each.
+ *       a queued job pins its directory's descriptor; once a quarter of
+ *       the descriptor limit is in use, scanning waits for the queues to
+ *       drain (and a merge batch is held to its share of the other half).
+ *     - at most --max-mapped bytes of big sidecars mapped at once.
+ *
+ * so, roughly, jobs x (depth x 150 bytes + subdirectory names along the
+ * path + the widest directory's index + 32 KiB) + merge jobs x (64 KiB
+ * [+ 4 MiB with -u]) + 1 MiB of queues + --max-mapped.
+ */
 
+const unsigned max_open_dirs = 32;
+const size_t chunk_size = 16384;
 
+/*
+ * --deadline: the checkpoint is a directory.  past it, directories already
+ * started are finished (and their merges and deletions drain), but no new
+ * ones are started, so the journal is left consistent.
+ */
+bool _has_deadline = false;
+std::chrono::steady_clock::time_point _deadline;
+std::atomic<bool> _stopped{false};
+
+bool past_deadline() {
+	if (!_has_deadline) return false;
+	if (_stopped) return true;
+	if (std::chrono::steady_clock::now() < _deadline) return false;
+	_stopped = true;
+	return true;
+}
 
-	std::error_code ec;
+/*
+ * a directory to clean, or a chunk of one that's already been listed.
+ */
+struct scan_task {
+	dir_ptr node;
+	// entries [begin, end) of node's listing; 0, 0 for the whole directory.
+	size_t begin = 0;
+	size_t end = 0;
 
-	if (rsrc_st.st_size == 0) {
-		// truncate any existing resource fork.
-		if (!afp::resource_fork::remove(data, ec))
-			throw_ec(ec, "resource_fork::remove()");
+	scan_task() = default;
+	scan_task(dir_ptr node) : node(std::move(node)) {}
+};
 
-		if (!_p) unlink_list.push_back(rsrc);
-		return;
+class walker {
+public:
+	walker(work_pool<scan_task> &pool, pipeline &stages) : _pool(pool), _stages(stages) {}
+
+	walker(const walker &) = delete;
+	walker &operator=(const walker &) = delete;
+
+	~walker() {
+		while (!_stack.empty()) leave();
 	}
 
-	mapped_file mf(rsrc, mapped_file::readonly, rsrc_st.st_size);
+	void run(scan_task &&task);
+
+private:
+
+	// node's subdirectories are _subdirs[first, last).
+	struct frame {
+		dir_ptr node;
+		size_t first;
+		size_t next;
+		size_t last;
+		bool chunk; // holds a pin on node rather than finishing it.
+
+		frame(dir_ptr node, size_t first, size_t last, bool chunk) :
+			node(std::move(node)), first(first), next(first), last(last), chunk(chunk)
+		{}
+	};
+
+	void enter(dir_ptr node);
+	void enter(scan_task &task);
+	void push(dir_ptr node, size_t first, bool chunk);
+	void leave();
+	bool resume(frame &f);
+	void spill(unsigned budget = max_open_dirs);
+	void throttle();
+	bool list(dir_node &dir, dir_scanner::type_filter need_type);
+	static unsigned char data_type(const name_index &index, const char *name, size_t length);
+	void apple_double_dir(const dir_ptr &node);
+	void one_entry(const dir_ptr &dir, const name_index::entry &e);
+
+	work_pool<scan_task> &_pool;
+	pipeline &_stages;
+	std::vector<frame> _stack;
+	std::vector<uint32_t> _subdirs; // offsets into the frames' listings, in stack order.
+	dir_scanner _scanner;
+	unsigned _open = 0;
+};
 
-	afp::resource_fork::write(data, mf.data(), mf.size(), ec);
-	if (ec) throw_ec(ec, "resource_fork::write()");
 
-	if (!_p) unlink_list.push_back(rsrc);
-} catch (const std::exception &ex) {
-	_rv = 1;
-	fprintf(stderr, "Merging %s failed: %s\n", rsrc.c_str(), ex.what());
-}
+/*
+ * read the whole directory into its listing.  a read error part way
+ * through leaves what was read.  with --inode-order the listing (and so
+ * the order sidecars are queued and subdirectories visited) is sorted by
+ * inode number.
+ */
+bool walker::list(dir_node &dir, dir_scanner::type_filter need_type) {
 
-void one_file(const std::string &data, const std::string &rsrc) noexcept try {
+	dir_scanner::entry e;
 
-	struct stat rsrc_st;
-	int ok;
+	if (!_scanner.open(dir.fd, need_type, thread_ring())) {
+		warn("%s", dir.path().c_str());
+		return false;
+	}
+	dir.listing = _listings.get();
+	while (_scanner.next(e)) dir.listing->insert(e.name, e.length, e.type, e.ino);
+	dir.listed = !errno;
+	if (errno) warn("%s", dir.path().c_str());
+	_scanner.close();
+	if (_inode_order) dir.listing->sort_by_inode();
+	return true;
+}
 
-	if (_v) fprintf(stdout, "Merging %s & %s\n", rsrc.c_str(), data.c_str());
+/*
+ * the data file's type, for one_file.  a name that isn't listed is gone --
+ * except with -n, where the sidecar is then deleted, so a miss (which might
+ * just be a case-insensitive filesystem) is confirmed with a stat first.
+ */
+unsigned char walker::data_type(const name_index &index, const char *name, size_t length) {
+	const name_index::entry *e = index.find(name, length);
+	if (e) return e->type;
+	return _n ? DT_UNKNOWN : dt_missing;
+}
 
-	ok = stat(data.c_str(), &rsrc_st);
-	if (ok < 0) {
-		if (errno == ENOENT) {
-			if (_n) unlink_list.push_back(rsrc);
-			return;			
-		}
-		throw_errno("stat");
+/*
+ * queue the contents of node/.AppleDouble (which is listed) to be merged
+ * and deleted; the folder itself goes once they're done (unless -p).  the
+ * data files are looked up in node's listing.
+ *
+ * node's own ._foo merges are held until then (see held_merges), so with
+ * a ._foo for .AppleDouble/foo too, ._foo is still merged second.
+ */
+void walker::apple_double_dir(const dir_ptr &node) {
+
+	auto ad = std::make_shared<dir_node>(node, ".AppleDouble");
+	if (!ad->open()) return;
+	if (_index.is_open()) index_listing(*ad);
+
+	node->pending++;
+	ad->pins_parent = true;
+	_held.hold(*node);
+	ad->remove = !_p;
+	if (_trash && ad->remove) {
+		const dir_node *root = node.get();
+		while (root->parent) root = root->parent.get();
+		ad->trash.reset(new trash_state(root->bin.get()));
 	}
 
-	// don't try to do directories.
-	if (S_ISDIR(rsrc_st.st_mode)) {
-		if (!_p) unlink_list.push_back(rsrc);
+	if (!list(*ad, nullptr)) {
+		ad->finish();
 		return;
 	}
 
-	int fd = open(data.c_str(), O_RDONLY | O_BINARY);
-	if (fd < 0) {
-		if (errno == ENOENT) {
-			if (_n) unlink_list.push_back(rsrc);
-			return;
+	const name_index &index = *ad->listing;
+	for (const auto &e : index) {
+		const char *name = index.name(e);
+
+		if (node->only && !node->only->names.count(std::string(".AppleDouble/").append(name, e.length))) {
+			if (ad->trash) ad->trash->add(e.offset, false);
+			continue;
 		}
-		throw_errno("open");
-	}
-	defer close_fd([fd]{close(fd); });
 
-	if (stat(rsrc.c_str(), &rsrc_st) < 0) throw_errno("stat");
-	if (rsrc_st.st_size == 0) {
-		// mmapping a zero-length file throws EINVAL.
-		if (!_p) unlink_list.push_back(rsrc);
-		return;
+		if (name[0] == '.') {
+			bool rm = _d && e.length == 9 && !memcmp(name, ".DS_Store", 9);
+			if (ad->trash) ad->trash->add(e.offset, rm);
+			else if (rm) _stages.unlink(unlink_job{ dir_ref(ad), e.offset });
+			continue;
+		}
+
+		merge_job job;
+		job.data_dir = dir_ref(node);
+		job.rsrc_dir = dir_ref(ad);
+		job.rsrc = job.data = e.offset;
+		job.data_length = e.length;
+		job.data_type = data_type(*node->listing, name, e.length);
+		_stages.merge(std::move(job));
 	}
 
-	mapped_file mf(rsrc, mapped_file::readonly, rsrc_st.st_size);
+	ad->finish();
+}
 
+void walker::one_entry(const dir_ptr &dir, const name_index::entry &e) {
 
-	if (mf.size() < sizeof(ASHeader)) throw_not_apple_double();
+	const name_index &index = *dir->listing;
+	const char *name = index.name(e);
+	name_class nc = classify_name(name, e.length);
 
-	ASHeader header;
+	if (dir->only && (nc.kind == name_plain || !dir->only->names.count(std::string(name, e.length))))
+		return;
 
-	{
-		ASHeader *tmp = (ASHeader *)mf.data();
+	switch (nc.kind) {
+		case name_hidden:
+			return;
 
-		header.magicNum = ntohl(tmp->magicNum);
-		header.versionNum = ntohl(tmp->versionNum);
-		header.numEntries = ntohs(tmp->numEntries);
-	}
+		case name_ds_store:
+			_stages.unlink(unlink_job{ dir_ref(dir), e.offset });
+			return;
 
-	if (header.magicNum != APPLEDOUBLE_MAGIC)
-		throw_not_apple_double();
+		case name_apple_double:
+		case name_raw_fork: {
+			const char *data = name + nc.data_offset;
+			merge_job job;
+			job.data_dir = dir_ref(dir);
+			job.rsrc_dir = job.data_dir;
+			job.rsrc = e.offset;
+			job.data = e.offset + nc.data_offset;
+			job.data_length = nc.data_length;
+			job.data_type = data_type(index, data, nc.data_length);
+			job.flat = nc.kind == name_raw_fork;
+			if (!_held.add(*dir, job)) _stages.merge(std::move(job));
+			return;
+		}
 
-	// v 2 is a super set of v1. v1 had type 7 for os-specific info, since split into
-	// separate entries.
-	if (header.versionNum != 0x00010000 && header.versionNum != 0x00020000)
-		throw_not_apple_double();
+		case name_plain:
+			break;
+	}
 
+	if (!_f && e.type == DT_DIR) _subdirs.push_back(e.offset);
+}
 
-	if (header.numEntries * sizeof(ASEntry) + sizeof(ASHeader) > mf.size()) throw_eof();
+/*
+ * open and clean a directory and push a frame for its subdirectories.
+ */
+void walker::enter(dir_ptr node) {
 
-	ASEntry *begin = (ASEntry *)(mf.data() + sizeof(ASHeader));
-	ASEntry *end = &begin[header.numEntries];
+	if (_v >= 2) {
+		fprintf(stdout, "Processing %s\n", node->display().c_str());
+	}
 
-	std::for_each(begin, end, [&mf](const ASEntry &tmp){
-		ASEntry e;
-		e.entryID = ntohl(tmp.entryID);
-		e.entryOffset = ntohl(tmp.entryOffset);
-		e.entryLength = ntohl(tmp.entryLength);
+	if (node->name.empty()) return;
 
-		// and check for truncation.
-		if (!e.entryLength) return;
-		if (e.entryOffset > mf.size()) throw_eof();
-		if (e.entryOffset + e.entryLength > mf.size()) throw_eof();
+	if (past_deadline()) {
+		if (node->queued) node->parent->release();
+		return;
+	}
 
-	});
+	throttle();
 
-	afp::finder_info fi;
-	std::error_code ec;
-	bool update_fi = false;
-	bool fi_ok = false;
+	bool ok = node->open();
+	if (node->queued) node->parent->release();
+	if (!ok) {
+		warn("%s", node->path().c_str());
+		return;
+	}
 
-	fi_ok = fi.open(data, afp::finder_info::read_write, ec);
+	if (_index.is_open()) index_listing(*node);
+	if (node->unchanged) {
+		// just the subdirectories.
+		_index.unchanged_dirs++;
+		node->listing = _listings.get();
+		const char *cp = _index.names(*node->unchanged);
+		const char *end = cp + node->unchanged->names_size;
+		for (; cp < end; cp += strlen(cp) + 1) node->listing->insert(cp, strlen(cp), DT_DIR);
+		node->listed = true;
+	} else if (!list(*node, need_type)) {
+		node->finish();
+		return;
+	}
 
-	std::for_each(begin, end, [&](const ASEntry &tmp){
+	const name_index &index = *node->listing;
 
-		ASEntry e;
-		e.entryID = ntohl(tmp.entryID);
-		e.entryOffset = ntohl(tmp.entryOffset);
-		e.entryLength = ntohl(tmp.entryLength);
+	// check for .AppleDouble folder.
+	if (index.find(".AppleDouble", 12) && (!node->only || node->only->apple_double))
+		apple_double_dir(node);
+
+	auto begin = index.begin();
+	auto end = index.end();
+
+	// after the .AppleDouble folder is queued, so ._foo can wait for it.
+	if (_pool.size() > 1 && index.size() > chunk_size) {
+		end = begin + chunk_size;
+		for (size_t i = chunk_size; i < index.size(); i += chunk_size) {
+			scan_task t(node);
+			t.begin = i;
+			t.end = std::min(i + chunk_size, index.size());
+			node->pending++;
+			_pool.push(std::move(t));
+		}
+	}
+	size_t first = _subdirs.size();
+	for (auto iter = begin; iter != end; ++iter) one_entry(node, *iter);
 
+	if (_subdirs.size() == first) {
+		node->finish();
+		return;
+	}
 
-		if (e.entryLength == 0) return;
-		switch(e.entryID) {
+	push(std::move(node), first, false);
+}
 
-			#if 0
-			/* should not exist for apple double! */
-			case AS_DATA: {
-				ssize_t ok = write(fd, mf.data() + e.entryOffset, e.entryLength);
-				if (ok < 0) throw_errno();
-				//if (ok != e.entryLength) return -1;
-				break;
-			}
-			#endif
-			case AS_RESOURCE: {
-				if (e.entryLength == 0) {
-					if (!afp::resource_fork::remove(data, ec))
-						throw_ec(ec, "resource_fork::remove()");
-				} else {
-					afp::resource_fork::write(data, mf.data()+ e.entryOffset, e.entryLength, ec);
-					if (ec) throw_ec(ec, "resource_fork::write()");
-				}
-				break;
-			}
+/*
+ * clean another worker's chunk of a directory.
+ */
+void walker::enter(scan_task &task) {
 
-			case AS_FINDERINFO: {
-				/* Apple now includes xattr w/ finder info */
-				if (e.entryLength < 32) {
-					fputs("Warning: Invalid Finder Info size.\n", stderr);
-					break;
-				}
-				memcpy(fi.data(), mf.data() + e.entryOffset, 32);
-				update_fi = true;
-				break;
-			}
+	auto begin = task.node->listing->begin() + task.begin;
+	auto end = task.node->listing->begin() + task.end;
 
-			case AS_PRODOSINFO: {
-				if (e.entryLength != 8) {
-					fputs("Warning: Invalid ProDOS Info size.\n", stderr);
-					break;
-				}
-				// fi.set_prodos_file_type(); ??? 
-				break;
-			}
-		}
-	});
+	size_t first = _subdirs.size();
+	for (auto iter = begin; iter != end; ++iter) one_entry(task.node, *iter);
 
-	if (update_fi) {
-		if (!fi.write(ec)) {
-			throw_ec(ec, "com.apple.FinderInfo");
-		}
+	if (_subdirs.size() == first) {
+		task.node->release();
+		return;
 	}
 
+	push(std::move(task.node), first, true);
+}
+
+void walker::push(dir_ptr node, size_t first, bool chunk) {
+	_stack.emplace_back(std::move(node), first, _subdirs.size(), chunk);
+	++_open;
+	if (_open > max_open_dirs) spill();
+}
 
-	if (!_p) unlink_list.push_back(rsrc);
+void walker::leave() {
+	frame &f = _stack.back();
 
-} catch (const std::exception &ex) {
-	_rv = 1;
-	fprintf(stderr, "Merging %s failed: %s\n", rsrc.c_str(), ex.what());
+	// cut short (a deadline, or it couldn't be reopened).
+	if (f.next != f.last) f.node->incomplete = true;
+
+	if (f.node->fd >= 0) --_open;
+	_subdirs.resize(f.first);
+	if (f.chunk) f.node->release();
+	else f.node->finish();
+	_stack.pop_back();
 }
 
-void unlink_files(std::vector<std::string> &unlink_list) {
+/*
+ * close the shallowest descriptors (but never one that queued work still
+ * needs) until we're back under budget.
+ */
+void walker::spill(unsigned budget) {
+
+	for (auto &f : _stack) {
+		if (_open <= budget) return;
+		if (&f == &_stack.back()) return;
+		if (f.node->fd < 0 || f.node->pending) continue;
+
+		struct stat st;
+		if (fstat(f.node->fd, &st) == 0) {
+			f.node->dev = st.st_dev;
+			f.node->ino = st.st_ino;
+		}
 
-	for (const auto &path : unlink_list) {
-		if (_v) fprintf(stdout, "Deleting %s\n", path.c_str());
-		int ok = unlink(path.c_str());
-		if (ok < 0) warn("unlink %s", path.c_str());
+		f.node->close_fd();
+		--_open;
 	}
-	unlink_list.clear();
 }
 
+/*
+ * every queued merge and deletion holds its directory open, so a scan that
+ * gets far ahead of them could run out of descriptors.  past _max_dir_fds,
+ * close what we can and let the later stages catch up.
+ */
+void walker::throttle() {
+	unsigned spins = 0;
+	while (_open_dirs >= _max_dir_fds) {
+		spill(0);
+		if (_open_dirs < _max_dir_fds || _job_pins == 0) return;
+		pipeline::backoff(spins);
+	}
+}
 
-std::string is_raw_resource_fork(const std::string &s) {
+/*
+ * reopen a spilled frame.  closed ancestors are reopened on the way down
+ * and closed again.
+ */
+bool walker::resume(frame &f) {
 
-	auto l = s.length();
-	if (l > 17 && !strncmp("_ResourceFork.bin", s.data() + l - 17, 17))
-		return s.substr(0, l - 17);
+	throttle();
 
-	if (l > 6 && !strncmp("_rsrc_", s.data() + l - 6, 6))
-		return s.substr(0, l - 6);
+	std::vector<dir_node *> chain;
+	for (dir_node *n = f.node.get(); n && n->fd < 0; n = n->parent.get())
+		chain.push_back(n);
 
-	return "";
-}
-void one_dir(std::string dir) noexcept {
+	for (auto iter = chain.rbegin(); iter != chain.rend(); ++iter) {
+		dir_node *n = *iter;
 
-	DIR *dirp;
-	dirent *dp;
+		int fd = openat(n->parent_fd(), n->name.c_str(), O_RDONLY | O_DIRECTORY);
+		// the parent was only reopened to get here.
+		if (iter != chain.rbegin()) n->parent->close_fd();
+		if (fd < 0) break;
 
-	if (_v >= 2) {
-		fprintf(stdout, "Processing %s\n", dir.c_str());
+		struct stat st;
+		if (n->ino && (fstat(fd, &st) < 0 || st.st_dev != n->dev || st.st_ino != n->ino)) {
+			close_dir(fd);
+			errno = ESTALE;
+			break;
+		}
+		n->adopt(fd);
 	}
 
-	// check for .AppleDouble folder.
+	if (f.node->fd < 0) {
+		warn("%s", f.node->path().c_str());
+		return false;
+	}
 
-	std::vector<std::string> dir_list;
+	++_open;
+	if (_open > max_open_dirs) spill();
+	return true;
+}
+
+void walker::run(scan_task &&task) {
 
-	if (dir.empty()) return;
+	if (task.end) enter(task);
+	else enter(std::move(task.node));
 
-	while (!dir.empty() && dir.back() == '/') dir.pop_back();
-	dir.push_back('/');
+	while (!_stack.empty()) {
+		frame &f = _stack.back();
 
-	std::string ad = dir + ".AppleDouble/";
+		if (f.next == f.last || past_deadline()) {
+			leave();
+			continue;
+		}
 
-	dirp = opendir(ad.c_str());
-	if (dirp) {
-		while ( (dp = readdir(dirp)) ) {
+		if (f.node->fd < 0 && !resume(f)) {
+			leave();
+			continue;
+		}
 
-			std::string name = dp->d_name;
-			if (name == ".DS_Store" && _d) {
-				unlink_list.push_back(ad + name);
+		const char *name = f.node->listing->name(_subdirs[f.next++]);
+		if (_journal.resuming()) {
+			std::string path = f.node->path() + name + '/';
+			if (_journal.finished(path)) {
+				if (_v >= 2) fprintf(stdout, "Skipping %.*s (finished)\n", (int)path.size() - 1, path.c_str());
 				continue;
 			}
+		}
 
-			if (name.front() == '.') continue;
+		auto child = std::make_shared<dir_node>(f.node, name);
 
-			one_file(dir + name, ad + name);
+		// give it away if there's room in the queue.
+		if (_pool.size() > 1 && _pool.queued() < 2 * _pool.size()) {
+			child->queued = true;
+			f.node->pending++;
+			_pool.push(std::move(child));
+			continue;
 		}
-		closedir(dirp);
 
-		unlink_files(unlink_list);
-		if (!_p) {
-			// try to delete it...
-			if (_v) fprintf(stdout, "Deleting %s\n", ad.c_str());
-			int ok = rmdir(ad.c_str());
-			if (ok < 0) warn("rmdir %s", ad.c_str());
-		}
+		enter(std::move(child)); // invalidates f
+	}
+}
+
+/*
+ * --purge: delete a trash folder and everything in it.
+ */
+bool remove_tree(int parent_fd, const char *name, const std::string &path) {
+
+	int fd = openat(parent_fd, name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW);
+	if (fd < 0) {
+		if (errno == ENOENT) return true;
+		warn("%s", path.c_str());
+		return false;
 	}
+	auto close_fd = defer([fd]{ close_dir(fd); });
 
+	dir_scanner scanner;
+	if (!scanner.open(fd, [](const char *, size_t){ return true; })) {
+		warn("%s", path.c_str());
+		return false;
+	}
 
-	dirp = opendir(dir.c_str());
-	if (dirp) {
-		while ( (dp = readdir(dirp)) ) {
+	bool ok = true;
+	dir_scanner::entry e;
+	std::string child;
+	while (scanner.next(e)) {
+		child = path;
+		child += '/';
+		child += e.name;
+		if (e.type == DT_DIR) {
+			if (!remove_tree(fd, e.name, child)) ok = false;
+			continue;
+		}
+		if (_v) fprintf(stdout, "Deleting %s\n", child.c_str());
+		if (unlinkat(fd, e.name, 0) < 0) {
+			warn("unlink %s", child.c_str());
+			ok = false;
+		}
+	}
+	if (errno) {
+		warn("%s", path.c_str());
+		ok = false;
+	}
+	scanner.close();
 
-			std::string name = dp->d_name;
+	if (!ok) return false;
+	if (_v) fprintf(stdout, "Deleting %s\n", path.c_str());
+	if (unlinkat(parent_fd, name, AT_REMOVEDIR) < 0) {
+		warn("rmdir %s", path.c_str());
+		return false;
+	}
+	return true;
+}
 
-			if (_d) {
-				if (name == ".DS_Store" || name == "._.DS_Store") {
-					unlink_list.push_back(dir + name);
-					continue;
-				}
-			}
+void walk(work_pool<scan_task> &pool, pipeline &stages) {
+	pool.run([&pool, &stages](scan_task &&task){
+		walker w(pool, stages);
+		w.run(std::move(task));
+	});
+}
 
+/*
+ * --watch: after the first pass, clean sidecars as they're written.
+ *
+ * events are gathered until it's been quiet for watch_quiet (or for at most
+ * watch_delay), then each directory with new sidecars is listed and just
+ * those are merged; one still being written is left for its own event.  a
+ * new directory is cleaned whole, since some of it may predate its watch,
+ * and after an overflow everything is.  a round's deletions are done before
+ * the next round lists anything.
+ */
+const std::chrono::milliseconds watch_quiet(100);
+const std::chrono::milliseconds watch_delay(1000);
 
-			if (name.length() > 2 && name[0] == '.' && name[1] == '_') {
+volatile sig_atomic_t _interrupted = 0;
 
-				one_file(dir + name.substr(2), dir + name);
-				continue;
-			}
+void interrupt(int) {
+	_interrupted = 1;
+}
 
-			/* _ResourceFork.bin or _rsrc_ raw resource data . */
-			std::string tmp = is_raw_resource_fork(name);
-			if (!tmp.empty()) {
-				one_flat_file(dir + tmp, dir + name);
-				continue;
+void watch_trees(dir_watch &watch, const std::vector<std::string> &roots, const std::vector<std::shared_ptr<trash_bin>> &bins, work_pool<scan_task> &pool, pipeline &stages) {
+
+	typedef std::chrono::steady_clock clock;
+
+	std::map<std::string, std::unique_ptr<watch_names>> changed;
+	std::set<std::string> new_dirs;
+	bool everything = false;
+	clock::time_point first;
+	clock::time_point last;
+	std::vector<dir_watch::event> events;
+
+	auto starts_with = [](const std::string &s, const std::string &prefix){
+		return !s.compare(0, prefix.size(), prefix);
+	};
+
+	// for --trash, the command line directory it's under.
+	auto push = [&](const std::string &path, std::unique_ptr<watch_names> only){
+		// moved or removed since.
+		struct stat st;
+		if (stat(path.c_str(), &st) < 0 && errno == ENOENT) return;
+
+		auto node = std::make_shared<dir_node>(nullptr, path);
+		size_t best = 0;
+		for (size_t i = 0; i < bins.size(); ++i) {
+			std::string root = roots[i];
+			if (root.back() != '/') root.push_back('/');
+			if (root.size() > best && starts_with(path, root)) {
+				node->bin = bins[i];
+				best = root.size();
 			}
+		}
+		node->only = std::move(only);
+		pool.push(std::move(node));
+	};
 
-			if (!_f && name[0] != '.') {
-				std::string tmp = dir + name;
-				#ifdef DT_DIR
-				if (dp->d_type == DT_DIR) {
-					dir_list.push_back(tmp);
-					continue;
-				}
-				#else
+	auto add = [&](const dir_watch::event &ev){
+		if (ev.kind == dir_watch::event::overflow) {
+			everything = true;
+			return;
+		}
+		if (ev.kind == dir_watch::event::directory) {
+			new_dirs.insert(ev.dir + ev.name + '/');
+			return;
+		}
+
+		std::string dir = ev.dir;
+		std::string key;
+		bool ad = false;
+		size_t n = dir.size();
+		if (n >= 13 && !dir.compare(n - 13, 13, ".AppleDouble/")) {
+			dir.resize(n - 13);
+			key = ".AppleDouble/" + ev.name;
+			ad = true;
+		} else {
+			name_class nc = classify_name(ev.name.c_str(), ev.name.size());
+			if (nc.kind == name_hidden) return;
+			if (nc.kind == name_plain) {
+				// a data file, after its sidecar.
 				struct stat st;
-				if (stat(tmp.c_str(), &st) == 0 && S_ISDIR(st.st_mode)) {
-					dir_list.push_back(tmp);
+				if (fstatat(AT_FDCWD, (dir + "._" + ev.name).c_str(), &st, AT_SYMLINK_NOFOLLOW) == 0) {
+					key = "._" + ev.name;
+				} else if (fstatat(AT_FDCWD, (dir + ".AppleDouble/" + ev.name).c_str(), &st, AT_SYMLINK_NOFOLLOW) == 0) {
+					key = ".AppleDouble/" + ev.name;
+					ad = true;
+				} else return;
+			} else key = ev.name;
+		}
+
+		auto &w = changed[dir];
+		if (!w) w.reset(new watch_names);
+		w->names.insert(std::move(key));
+		if (ad) w->apple_double = true;
+	};
+
+	auto flush = [&]{
+		if (everything) {
+			for (auto &root : roots) push(root, nullptr);
+		} else {
+			// nested new directories are cleaned with the outermost.
+			const std::string *top = nullptr;
+			for (auto iter = new_dirs.begin(); iter != new_dirs.end(); ) {
+				if (top && starts_with(*iter, *top)) {
+					iter = new_dirs.erase(iter);
 					continue;
 				}
-				#endif
+				top = &*iter;
+				push(*iter++, nullptr);
+			}
+			for (auto &c : changed) {
+				auto iter = new_dirs.upper_bound(c.first);
+				if (iter != new_dirs.begin() && starts_with(c.first, *--iter)) continue;
+				push(c.first, std::move(c.second));
 			}
-
-
-
 		}
-		closedir(dirp);
-	} else {
-		warn("%s", dir.c_str());
-	}
+		changed.clear();
+		new_dirs.clear();
+		everything = false;
+
+		walk(pool, stages);
+		unsigned spins = 0;
+		while (_job_pins) pipeline::backoff(spins);
+	};
+
+	if (_v) fprintf(stdout, "Watching for new sidecars (%s)\n", watch.method());
+	fflush(stdout);
+
+	signal(SIGINT, interrupt);
+	signal(SIGTERM, interrupt);
+
+	auto ms = [](clock::duration d){
+		return (int)std::chrono::duration_cast<std::chrono::milliseconds>(d).count() + 1;
+	};
+
+	while (!_interrupted) {
+		auto now = clock::now();
+		if (_has_deadline && now >= _deadline) break;
+
+		bool waiting = everything || !new_dirs.empty() || !changed.empty();
+		int timeout = 1000;
+		if (waiting) {
+			auto due = std::min(last + watch_quiet, first + watch_delay);
+			if (now >= due) {
+				flush();
+				fflush(stdout);
+				continue;
+			}
+			timeout = ms(due - now);
+		}
+		if (_has_deadline) timeout = std::min(timeout, ms(_deadline - now));
 
-	unlink_files(unlink_list);
+		events.clear();
+		if (!watch.read(events, timeout)) {
+			warn("watch");
+			_rv = 1;
+			break;
+		}
+		if (events.empty()) continue;
 
-	for (const auto &path : dir_list) one_dir(path);
+		now = clock::now();
+		if (!waiting) first = now;
+		last = now;
+		for (const auto &ev : events) add(ev);
+	}
 
+	signal(SIGINT, SIG_DFL);
+	signal(SIGTERM, SIG_DFL);
 }
 
 void usage() {
-	fputs("Usage: dot_clean [-fhmnpsv] directory ...\n", stderr);
+	fputs("Usage: dot_clean [-dfhmnpsuv] [-j jobs] [--merge-jobs n] [--delete-jobs n] [--max-mapped MiB] [--prefetch n] [--background] [--durable] [--skip-identical] [--verify] [--inode-order] [--trash | --purge] [--journal file [--resume]] [--deadline time] [--index file] [--watch] directory ...\n", stderr);
 	exit(EX_USAGE);
 }
 
 void help() {
 	fputs(
-		"Usage: dot_clean [-fhmnpsv] directory ...\n"
+		"Usage: dot_clean [-dfhmnpsuv] [-j jobs] [--merge-jobs n] [--delete-jobs n] [--max-mapped MiB] [--prefetch n] [--background] [--durable] [--skip-identical] [--verify] [--inode-order] [--trash | --purge] [--journal file [--resume]] [--deadline time] [--index file] [--watch] directory ...\n"
 		"\n"
 		"    -d Delete .DS_Store files.\n"
 		"    -f Disable recursion\n"
 		"    -h Display help\n"
+		"    -j Number of directory scanning jobs (0 = one per cpu)\n"
 		"    -m Always delete apple double files\n"
 		"    -n Delete apple double files if there is no matching native file\n"
 		"    -p Preserve apple double file.\n"
 		"    -s Follow symbolic links.\n"
-		"    -v Be verbose\n",
+		"    -u Use io_uring for batched I/O (Linux)\n"
+		"    -v Be verbose\n"
+		"    --merge-jobs n     Number of merging jobs (default: same as -j)\n"
+		"    --delete-jobs n    Number of deleting jobs (default: 1)\n"
+		"    --max-mapped MiB   Limit on large apple double files mapped at once (default: 256)\n"
+		"    --prefetch n       Most sidecars each merge job reads ahead, without -u (default: 32)\n"
+		"    --background       Leave the page cache and access times alone where possible\n"
+		"    --durable          Sync merged forks to disk before deleting their sidecars\n"
+		"    --skip-identical   Don't rewrite forks that already match the sidecar\n"
+		"    --verify           Read back and check the forks before removing sidecars\n"
+		"    --inode-order      Process each directory in inode order (fewer seeks on hard disks)\n"
+		"    --trash            Move merged .AppleDouble folders to directory/.dot_clean_trash\n"
+		"    --purge            Only empty directory/.dot_clean_trash\n"
+		"    --journal file     Record progress in file, to resume an interrupted run\n"
+		"    --resume           Skip what the --journal file says is done\n"
+		"    --deadline time    Start no new directories after time (seconds, or 30m, 8h)\n"
+		"    --index file       Don't reread directories unchanged since the run that wrote file\n"
+		"    --watch            Keep running, cleaning new sidecars as they're written (Linux)\n",
 		stdout);
 
 	exit(EX_OK);
 }
 
+// 0 is one per cpu.
+unsigned job_count(const char *arg) {
+	char *cp;
+	unsigned long l = strtoul(arg, &cp, 10);
+	if (*cp || cp == arg || l > 1024) {
+		warnx("invalid job count: %s", arg);
+		usage();
+	}
+	return l ? l : std::max(1u, std::thread::hardware_concurrency());
+}
+
 int main(int argc, char **argv) {
 
-	int c;
+	enum { opt_merge_jobs = 256, opt_delete_jobs, opt_max_mapped, opt_trash, opt_purge, opt_inode_order, opt_prefetch, opt_background, opt_durable, opt_skip_identical, opt_verify, opt_journal, opt_resume, opt_deadline, opt_index, opt_watch };
+
+	static struct option long_options[] = {
+		{ "help", no_argument, nullptr, 'h' },
+		{ "jobs", required_argument, nullptr, 'j' },
+		{ "merge-jobs", required_argument, nullptr, opt_merge_jobs },
+		{ "delete-jobs", required_argument, nullptr, opt_delete_jobs },
+		{ "max-mapped", required_argument, nullptr, opt_max_mapped },
+		{ "trash", no_argument, nullptr, opt_trash },
+		{ "purge", no_argument, nullptr, opt_purge },
+		{ "inode-order", no_argument, nullptr, opt_inode_order },
+		{ "prefetch", required_argument, nullptr, opt_prefetch },
+		{ "background", no_argument, nullptr, opt_background },
+		{ "durable", no_argument, nullptr, opt_durable },
+		{ "skip-identical", no_argument, nullptr, opt_skip_identical },
+		{ "verify", no_argument, nullptr, opt_verify },
+		{ "journal", required_argument, nullptr, opt_journal },
+		{ "resume", no_argument, nullptr, opt_resume },
+		{ "deadline", required_argument, nullptr, opt_deadline },
+		{ "index", required_argument, nullptr, opt_index },
+		{ "watch", no_argument, nullptr, opt_watch },
+		{ nullptr, 0, nullptr, 0 }
+	};
 
-	while ((c = getopt(argc, argv, "dfhmnpsvo:")) != -1) {
+	int c;
+	bool purge = false;
+	const char *journal_path = nullptr;
+	const char *index_path = nullptr;
+	bool watch = false;
+	bool resume = false;
+	unsigned long deadline = 0;
+
+	while ((c = getopt_long(argc, argv, "dfhj:mnpsuvo:", long_options, nullptr)) != -1) {
 		switch(c) {
 			case 'd': _d = true; break;
 			case 'f': _f = true; break;
 			case 'h': help(); break;
+			case 'j': _j = job_count(optarg); break;
 			case 'm': _m = true; break;
 			case 'n': _n = true; break;
 			case 'p': _p = true; break;
 			case 's': _s = true; break;
+			case 'u': _u = true; break;
 			case 'v': _v++; break;
 			case 'o': {
 				if (strcmp(optarg, "-")) {
@@ -475,6 +3340,54 @@ int main(int argc, char **argv) {
 				}
 				break;
 			}
+			case opt_merge_jobs: _merge_jobs = job_count(optarg); break;
+			case opt_delete_jobs: _delete_jobs = job_count(optarg); break;
+			case opt_trash: _trash = true; break;
+			case opt_purge: purge = true; break;
+			case opt_inode_order: _inode_order = true; break;
+			case opt_background: _background = true; break;
+			case opt_durable: _durable = true; break;
+			case opt_skip_identical: _skip_identical = true; break;
+			case opt_verify: _verify = true; break;
+			case opt_journal: journal_path = optarg; break;
+			case opt_resume: resume = true; break;
+			case opt_index: index_path = optarg; break;
+			case opt_watch: watch = true; break;
+			case opt_deadline: {
+				char *cp;
+				unsigned long l = strtoul(optarg, &cp, 10);
+				unsigned long scale = 1;
+				if (*cp == 'm') scale = 60;
+				if (*cp == 'h') scale = 60 * 60;
+				if (*cp == 's' || *cp == 'm' || *cp == 'h') ++cp;
+				if (*cp || cp == optarg || l > 366 * 24 * 60 * 60 / scale) {
+					warnx("invalid deadline: %s", optarg);
+					usage();
+				}
+				deadline = l * scale;
+				_has_deadline = true;
+				break;
+			}
+			case opt_prefetch: {
+				char *cp;
+				unsigned long l = strtoul(optarg, &cp, 10);
+				if (*cp || cp == optarg || l > 4096) {
+					warnx("invalid prefetch window: %s", optarg);
+					usage();
+				}
+				_prefetch = l;
+				break;
+			}
+			case opt_max_mapped: {
+				char *cp;
+				unsigned long l = strtoul(optarg, &cp, 10);
+				if (*cp || cp == optarg || l == 0 || l > 1024 * 1024) {
+					warnx("invalid size: %s", optarg);
+					usage();
+				}
+				_max_mapped = (size_t)l << 20;
+				break;
+			}
 			case ':':
 			case '?':
 			default:
@@ -487,8 +3400,85 @@ int main(int argc, char **argv) {
 	argc -= optind;
 
 	if (!argc) usage();
+	if (_trash && purge) usage();
+	if (resume && !journal_path) usage();
+	// the index has to know every directory's subdirectories.
+	if (index_path && _f) usage();
+	// there's no end to record.
+	if (watch && journal_path) usage();
+
+	#ifdef _WIN32
+	if (_durable) errx(EX_UNAVAILABLE, "--durable isn't supported on Windows");
+	#endif
+
+	if (_has_deadline) _deadline = std::chrono::steady_clock::now() + std::chrono::seconds(deadline);
+
+	if (purge) {
+		for (int i = 0; i < argc; ++i) {
+			std::string path = argv[i];
+			while (!path.empty() && path.back() == '/') path.pop_back();
+			path += '/';
+			path += trash_name;
+			if (!remove_tree(AT_FDCWD, path.c_str(), path)) _rv = 1;
+		}
+		return _rv;
+	}
+
+	if (!_merge_jobs) _merge_jobs = _j;
 
-	for (int i = 0; i < argc; ++i) one_dir(argv[i]);
+	// a quarter of the descriptors for directories, half for merge batches.
+	#ifndef _WIN32
+	struct rlimit rl;
+	if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur != RLIM_INFINITY) {
+		_max_dir_fds = std::max<rlim_t>(8, rl.rlim_cur / 4);
+		_merge_fds = std::max<rlim_t>(2, rl.rlim_cur / 2 / _merge_jobs);
+	}
+	#endif
+	// the window's sidecars come out of the merge batch's share.
+	_prefetch = std::min(_prefetch, _merge_fds / 2);
+
+	io_usage start_io = current_io();
+	if (journal_path) _journal.open(journal_path, resume);
+	if (index_path) _index.open(index_path);
+	pipeline stages(_merge_jobs, _delete_jobs);
+
+	std::vector<std::string> roots(argv, argv + argc);
+	std::vector<std::shared_ptr<trash_bin>> bins;
+
+	// before the first pass, so nothing written during it is missed.
+	dir_watch watcher;
+	if (watch && !watcher.init(roots)) err(EX_UNAVAILABLE, "--watch");
+
+	work_pool<scan_task> pool(_j);
+	for (const auto &path : roots) {
+		auto root = std::make_shared<dir_node>(nullptr, path);
+		if (_trash) {
+			root->bin = std::make_shared<trash_bin>(root->path() + trash_name);
+			bins.push_back(root->bin);
+		}
+		if (_journal.finished(root->path())) {
+			if (_v >= 2) fprintf(stdout, "Skipping %s (finished)\n", root->display().c_str());
+			continue;
+		}
+		pool.push(std::move(root));
+	}
+
+	walk(pool, stages);
+	if (watch && !_stopped) watch_trees(watcher, roots, bins, pool, stages);
+
+	stages.finish();
+	if (index_path) _index.save(_stopped || _journal.resuming());
+	_journal.close();
+	if (_stopped) {
+		warnx("deadline reached%s", journal_path ? "; --resume to continue" : "");
+		if (!_rv) _rv = EX_TEMPFAIL;
+	}
+	if (_v) {
+		report_failures();
+		if (_skip_identical || _verify) report_forks();
+		if (index_path) fprintf(stdout, "%u directories unchanged since the last run\n", _index.unchanged_dirs.load());
+		report_io(start_io);
+	}
 
 	return _rv;
 }
@@ -0,0 +1,230 @@
+#include "forks.h"
+#include "crc32c.h"
+
+#include <errno.h>
+#include <string.h>
+
+#include <memory>
+#include <vector>
+
+#if defined(__APPLE__) || defined(__linux__)
+#define FORKS_XATTR 1
+#include <sys/xattr.h>
+#elif defined(__FreeBSD__)
+#define FORKS_EXTATTR 1
+#include <sys/types.h>
+#include <sys/extattr.h>
+#else
+#include <afp/finder_info.h>
+#include <afp/resource_fork.h>
+#endif
+
+namespace {
+
+#if defined(__APPLE__)
+	const char *resource_fork_name = XATTR_RESOURCEFORK_NAME;
+	const char *finder_info_name = XATTR_FINDERINFO_NAME;
+#elif defined(__linux__)
+	const char *resource_fork_name = "user.com.apple.ResourceFork";
+	const char *finder_info_name = "user.com.apple.FinderInfo";
+#elif defined(FORKS_EXTATTR)
+	const char *resource_fork_name = "com.apple.ResourceFork";
+	const char *finder_info_name = "com.apple.FinderInfo";
+#endif
+
+#if defined(FORKS_XATTR) || defined(FORKS_EXTATTR)
+
+	#ifndef ENOATTR
+	#define ENOATTR ENODATA
+	#endif
+
+	bool set_error(std::error_code &ec) {
+		ec = std::error_code(errno, std::generic_category());
+		return false;
+	}
+
+	bool set_attr(int fd, const char *name, const void *data, size_t size, std::error_code &ec) {
+		ec.clear();
+		#if defined(__APPLE__)
+		if (fsetxattr(fd, name, data, size, 0, 0) < 0) return set_error(ec);
+		#elif defined(FORKS_XATTR)
+		if (fsetxattr(fd, name, data, size, 0) < 0) return set_error(ec);
+		#else
+		if (extattr_set_fd(fd, EXTATTR_NAMESPACE_USER, name, data, size) < 0) return set_error(ec);
+		#endif
+		return true;
+	}
+
+	ssize_t get_attr(int fd, const char *name, void *data, size_t size) {
+		#if defined(__APPLE__)
+		return fgetxattr(fd, name, data, size, 0, 0);
+		#elif defined(FORKS_XATTR)
+		return fgetxattr(fd, name, data, size);
+		#else
+		return extattr_get_fd(fd, EXTATTR_NAMESPACE_USER, name, data, size);
+		#endif
+	}
+
+	// kept for the next one, unless it's a big one.
+	std::vector<unsigned char> &scratch() {
+		static thread_local std::vector<unsigned char> buffer;
+		return buffer;
+	}
+
+	void trim_scratch() {
+		auto &buffer = scratch();
+		if (buffer.capacity() > 1024 * 1024) std::vector<unsigned char>().swap(buffer);
+	}
+
+	bool same_attr(int fd, const char *name, const void *data, size_t size) {
+		ssize_t n = get_attr(fd, name, nullptr, 0);
+		if (n < 0 || (size_t)n != size) return false;
+		if (size == 0) return true;
+
+		auto &buffer = scratch();
+		buffer.resize(size);
+		n = get_attr(fd, name, buffer.data(), size);
+		bool rv = n == (ssize_t)size && !memcmp(buffer.data(), data, size);
+		trim_scratch();
+		return rv;
+	}
+
+	bool checksum_attr(int fd, const char *name, size_t &size, uint32_t &crc, std::error_code &ec) {
+		ec.clear();
+		size = 0;
+		crc = 0;
+		ssize_t n = get_attr(fd, name, nullptr, 0);
+		if (n < 0) return errno == ENOATTR ? true : set_error(ec);
+		if (n == 0) return true;
+
+		auto &buffer = scratch();
+		buffer.resize(n);
+		// ERANGE if it grew in between, which is an error here too.
+		ssize_t nn = get_attr(fd, name, buffer.data(), n);
+		if (nn < 0) {
+			set_error(ec);
+			trim_scratch();
+			return false;
+		}
+		size = nn;
+		crc = crc32c(0, buffer.data(), nn);
+		trim_scratch();
+		return true;
+	}
+
+	bool remove_attr(int fd, const char *name, std::error_code &ec) {
+		ec.clear();
+		#if defined(__APPLE__)
+		int ok = fremovexattr(fd, name, 0);
+		#elif defined(FORKS_XATTR)
+		int ok = fremovexattr(fd, name);
+		#else
+		int ok = extattr_delete_fd(fd, EXTATTR_NAMESPACE_USER, name);
+		#endif
+		if (ok < 0 && errno != ENOATTR) return set_error(ec);
+		return true;
+	}
+
+#endif
+
+}
+
+namespace forks {
+
+#if defined(FORKS_XATTR) || defined(FORKS_EXTATTR)
+
+	bool write_resource_fork(int fd, const std::string &, const void *data, size_t size, std::error_code &ec) {
+		return set_attr(fd, resource_fork_name, data, size, ec);
+	}
+
+	bool remove_resource_fork(int fd, const std::string &, std::error_code &ec) {
+		return remove_attr(fd, resource_fork_name, ec);
+	}
+
+	bool write_finder_info(int fd, const std::string &, const void *data, std::error_code &ec) {
+		return set_attr(fd, finder_info_name, data, 32, ec);
+	}
+
+	bool same_resource_fork(int fd, const std::string &, const void *data, size_t size) {
+		return same_attr(fd, resource_fork_name, data, size);
+	}
+
+	bool same_finder_info(int fd, const std::string &, const void *data) {
+		return same_attr(fd, finder_info_name, data, 32);
+	}
+
+	bool checksum_resource_fork(int fd, const std::string &, size_t &size, uint32_t &crc, std::error_code &ec) {
+		return checksum_attr(fd, resource_fork_name, size, crc, ec);
+	}
+
+	bool checksum_finder_info(int fd, const std::string &, size_t &size, uint32_t &crc, std::error_code &ec) {
+		return checksum_attr(fd, finder_info_name, size, crc, ec);
+	}
+
+#else
+
+	bool write_resource_fork(int, const std::string &path, const void *data, size_t size, std::error_code &ec) {
+		return afp::resource_fork::write(path, data, size, ec);
+	}
+
+	bool remove_resource_fork(int, const std::string &path, std::error_code &ec) {
+		return afp::resource_fork::remove(path, ec);
+	}
+
+	bool write_finder_info(int, const std::string &path, const void *data, std::error_code &ec) {
+		afp::finder_info fi;
+		if (!fi.open(path, afp::finder_info::read_write, ec) && ec) return false;
+		memcpy(fi.data(), data, 32);
+		return fi.write(ec);
+	}
+
+	bool same_resource_fork(int, const std::string &path, const void *data, size_t size) {
+		std::error_code ec;
+		afp::resource_fork rf;
+		if (!rf.open(path, afp::resource_fork::read_only, ec)) return false;
+		if (rf.size(ec) != size || ec) return false;
+		if (size == 0) return true;
+
+		std::unique_ptr<unsigned char[]> buffer(new unsigned char[size]);
+		if (rf.read(buffer.get(), size, ec) != size || ec) return false;
+		return !memcmp(buffer.get(), data, size);
+	}
+
+	bool same_finder_info(int, const std::string &path, const void *data) {
+		std::error_code ec;
+		afp::finder_info fi;
+		if (!fi.open(path, afp::finder_info::read_only, ec)) return false;
+		return !memcmp(fi.data(), data, 32);
+	}
+
+	bool checksum_resource_fork(int, const std::string &path, size_t &size, uint32_t &crc, std::error_code &ec) {
+		size = 0;
+		crc = 0;
+		afp::resource_fork rf;
+		if (!rf.open(path, afp::resource_fork::read_only, ec)) return false;
+
+		// in pieces, so a big fork isn't read into memory at once.
+		unsigned char buffer[64 * 1024];
+		for(;;) {
+			size_t n = rf.read(buffer, sizeof(buffer), ec);
+			if (ec) return false;
+			if (n == 0) break;
+			crc = crc32c(crc, buffer, n);
+			size += n;
+		}
+		return true;
+	}
+
+	bool checksum_finder_info(int, const std::string &path, size_t &size, uint32_t &crc, std::error_code &ec) {
+		size = 0;
+		crc = 0;
+		afp::finder_info fi;
+		if (!fi.open(path, afp::finder_info::read_only, ec)) return false;
+		size = 32;
+		crc = crc32c(0, fi.data(), 32);
+		return true;
+	}
+
+#endif
+
+}
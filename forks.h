@@ -0,0 +1,43 @@
+#ifndef __forks_h__
+#define __forks_h__
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string>
+#include <system_error>
+
+/*
+ * resource fork and finder info writes through an open data file, so a
+ * merge resolves the data file's path once.
+ *
+ * macos, linux and freebsd set the extended attributes on the descriptor.
+ * elsewhere (windows streams, solaris O_XATTR) these fall back to afp with
+ * the path, which is only used for that.
+ */
+
+namespace forks {
+
+	bool write_resource_fork(int fd, const std::string &path, const void *data, size_t size, std::error_code &ec);
+
+	// not an error if there isn't one.
+	bool remove_resource_fork(int fd, const std::string &path, std::error_code &ec);
+
+	// all 32 bytes are replaced, so there's nothing to read first.
+	bool write_finder_info(int fd, const std::string &path, const void *data, std::error_code &ec);
+
+	/*
+	 * whether the file already has exactly this fork -- length first, then
+	 * the contents.  no fork, or any error reading it, is a mismatch.
+	 */
+	bool same_resource_fork(int fd, const std::string &path, const void *data, size_t size);
+	bool same_finder_info(int fd, const std::string &path, const void *data);
+
+	/*
+	 * the fork as it is now -- its length and crc32c -- read back to check a
+	 * write.  no fork is length 0.
+	 */
+	bool checksum_resource_fork(int fd, const std::string &path, size_t &size, uint32_t &crc, std::error_code &ec);
+	bool checksum_finder_info(int fd, const std::string &path, size_t &size, uint32_t &crc, std::error_code &ec);
+}
+
+#endif
@@ -16,6 +16,7 @@ namespace {
 
 #ifdef _WIN32
 #include <windows.h>
+#include <io.h>
 
 namespace {
 
@@ -50,7 +51,7 @@ void mapped_file_base::close() {
 
 		UnmapViewOfFile(_data);
 		CloseHandle(_map_handle);
-		CloseHandle(_file_handle);
+		if (_file_handle) CloseHandle(_file_handle);
 		reset();
 	}
 }
@@ -82,7 +83,7 @@ void mapped_file_base::open_common(const T& p, mapmode flags, size_t length, siz
 	auto fh_close = make_unique_resource(fh, CloseHandle);
 
 
-	if (length == -1) {
+	if (length == static_cast<size_t>(-1)) {
 		LARGE_INTEGER file_size;
 		GetFileSizeEx(fh, &file_size);
 		length = (size_t)file_size.QuadPart;
@@ -142,6 +143,71 @@ void mapped_file_base::open(const std::wstring &p, mapmode flags, size_t length,
 }
 
 
+void mapped_file_base::open(int fd, mapmode flags, size_t length, size_t offset, std::error_code *ec) {
+
+	if (ec) ec->clear();
+
+	HANDLE fh;
+	HANDLE mh;
+
+	if (is_open()) close();
+
+	fh = (HANDLE)_get_osfhandle(fd);
+	if (fh == INVALID_HANDLE_VALUE)
+		return set_or_throw_error(ec, ERROR_INVALID_HANDLE, "_get_osfhandle");
+
+	if (length == static_cast<size_t>(-1)) {
+		LARGE_INTEGER file_size;
+		GetFileSizeEx(fh, &file_size);
+		length = (size_t)file_size.QuadPart;
+	}
+
+	if (length == 0) return;
+
+	DWORD protect = 0;
+	DWORD access = 0;
+	switch (flags) {
+	case readonly:
+		protect = PAGE_READONLY;
+		access = FILE_MAP_READ;
+		break;
+	case readwrite:
+		protect = PAGE_READWRITE;
+		access = FILE_MAP_WRITE;
+		break;
+	case priv:
+		protect = PAGE_WRITECOPY;
+		access = FILE_MAP_COPY;
+		break;
+	}
+
+	mh = CreateFileMapping(fh, nullptr, protect, 0, 0, 0);
+	if (mh == nullptr)
+		return set_or_throw_error(ec, "CreateFileMapping");
+
+	auto mh_close = make_unique_resource(mh, CloseHandle);
+
+
+	ULARGE_INTEGER ll;
+	ll.QuadPart = offset;
+
+	_data = MapViewOfFileEx(mh, 
+		access, 
+		ll.HighPart,
+		ll.LowPart,
+		length, 
+		nullptr);
+	if (!_data)
+		return set_or_throw_error(ec, "MapViewOfFileEx");
+
+	// the file handle belongs to the caller's descriptor.
+	_file_handle = nullptr;
+	_map_handle = mh_close.release();
+	_size = length;
+	_flags = flags;
+}
+
+
 
 
 template<class T>
@@ -241,7 +307,7 @@ namespace {
 void mapped_file_base::close() {
 	if (is_open()) {
 		::munmap(_data, _size);
-		::close(_fd);
+		if (_fd >= 0) ::close(_fd);
 		reset();
 	}
 }
@@ -274,7 +340,7 @@ void mapped_file_base::open(const std::string& p, mapmode flags, size_t length,
 	auto close_fd = make_unique_resource(fd, ::close);
 
 
-	if (length == -1) {
+	if (length == static_cast<size_t>(-1)) {
 		struct stat st;
 
 		if (::fstat(fd, &st) < 0) {
@@ -301,6 +367,40 @@ void mapped_file_base::open(const std::string& p, mapmode flags, size_t length,
 	_flags = flags;
 }
 
+void mapped_file_base::open(int fd, mapmode flags, size_t length, size_t offset, std::error_code *ec) {
+
+	if (ec) ec->clear();
+
+	if (is_open()) close();
+
+	if (length == static_cast<size_t>(-1)) {
+		struct stat st;
+
+		if (::fstat(fd, &st) < 0) {
+			set_or_throw_error(ec, "stat");
+			return;
+		}
+		length = st.st_size;
+	}
+
+	if (length == 0) return;
+
+	_data = ::mmap(0, length, 
+		flags == readonly ? PROT_READ : PROT_READ | PROT_WRITE, 
+		flags == priv ? MAP_PRIVATE : MAP_SHARED, 
+		fd, offset);
+
+	if (_data == MAP_FAILED) {
+		_data = nullptr;
+		return set_or_throw_error(ec, "mmap");
+	}
+
+	// the mapping doesn't need the descriptor and it isn't ours to close.
+	_fd = -1;
+	_size = length;
+	_flags = flags;
+}
+
 void mapped_file_base::create(const std::string& p, size_t length, std::error_code *ec) {
 
 	if (ec) ec->clear();
@@ -34,6 +34,9 @@ protected:
 	void open(const std::string &p, mapmode flags, size_t length, size_t offset, std::error_code *ec);
 	void create(const std::string &p, size_t new_size, std::error_code *ec); // always creates readwrite.
 
+	// maps an already open file descriptor.  the descriptor is borrowed, not closed.
+	void open(int fd, mapmode flags, size_t length, size_t offset, std::error_code *ec);
+
 #ifdef _WIN32
 
 	void open(const std::wstring &p, mapmode flags, size_t length, size_t offset, std::error_code *ec);
@@ -100,6 +103,14 @@ public:
 	}
 
 
+	mapped_file(int fd, mapmode flags = readonly, size_t length = -1, size_t offset = 0) {
+		open(fd, flags, length, offset);
+	}
+
+	mapped_file(int fd, mapmode flags, size_t length, std::error_code &ec) noexcept {
+		open(fd, flags, length, 0, ec);
+	}
+
 	mapped_file(mapped_file &&);
 	mapped_file(const mapped_file &) = delete;
 
@@ -123,6 +134,16 @@ public:
 		base::open(p, flags, length, offset, &ec);
 	}
 
+	void open(int fd, mapmode flags, size_t length = -1, size_t offset = 0) {
+		base::open(fd, flags, length, offset, nullptr);
+	}
+	void open(int fd, mapmode flags, size_t length, std::error_code &ec) noexcept {
+		base::open(fd, flags, length, 0, &ec);
+	}
+	void open(int fd, mapmode flags, size_t length, size_t offset, std::error_code &ec) noexcept {
+		base::open(fd, flags, length, offset, &ec);
+	}
+
 #ifdef _WIN32
 	void open(const std::wstring &p, mapmode flags, size_t length = -1, size_t offset = 0) {
 		base::open(p, flags, length, offset, nullptr);
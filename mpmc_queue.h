@@ -0,0 +1,98 @@
+#ifndef __mpmc_queue_h__
+#define __mpmc_queue_h__
+
+#include <atomic>
+#include <memory>
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * bounded multi-producer / multi-consumer queue (dmitry vyukov's).
+ *
+ * a fixed ring of cells, each with a sequence number saying whose turn it
+ * is; push and pop claim a cell with one compare-exchange and never block.
+ * waiting for room or for work is up to the caller.
+ *
+ * capacity is rounded up to a power of 2.  T must be default constructible
+ * and move assignable.
+ */
+
+template<class T>
+class mpmc_queue {
+public:
+
+	explicit mpmc_queue(size_t capacity) {
+		size_t n = 2;
+		while (n < capacity) n <<= 1;
+		_mask = n - 1;
+		_cells.reset(new cell[n]);
+		for (size_t i = 0; i < n; ++i) _cells[i].seq.store(i, std::memory_order_relaxed);
+	}
+
+	mpmc_queue(const mpmc_queue &) = delete;
+	mpmc_queue &operator=(const mpmc_queue &) = delete;
+
+	size_t capacity() const { return _mask + 1; }
+
+	bool try_push(T &&t) {
+		size_t pos = _tail.load(std::memory_order_relaxed);
+		for(;;) {
+			cell &c = _cells[pos & _mask];
+			size_t seq = c.seq.load(std::memory_order_acquire);
+			intptr_t diff = (intptr_t)seq - (intptr_t)pos;
+			if (diff == 0) {
+				if (_tail.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+					c.value = std::move(t);
+					c.seq.store(pos + 1, std::memory_order_release);
+					return true;
+				}
+			} else if (diff < 0) {
+				return false; // full
+			} else {
+				pos = _tail.load(std::memory_order_relaxed);
+			}
+		}
+	}
+
+	bool try_pop(T &t) {
+		size_t pos = _head.load(std::memory_order_relaxed);
+		for(;;) {
+			cell &c = _cells[pos & _mask];
+			size_t seq = c.seq.load(std::memory_order_acquire);
+			intptr_t diff = (intptr_t)seq - (intptr_t)(pos + 1);
+			if (diff == 0) {
+				if (_head.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+					t = std::move(c.value);
+					c.value = T();
+					c.seq.store(pos + _mask + 1, std::memory_order_release);
+					return true;
+				}
+			} else if (diff < 0) {
+				return false; // empty
+			} else {
+				pos = _head.load(std::memory_order_relaxed);
+			}
+		}
+	}
+
+	// a hint, unless nothing else is pushing or popping.
+	bool empty() const {
+		return _head.load(std::memory_order_acquire) == _tail.load(std::memory_order_acquire);
+	}
+
+private:
+
+	struct cell {
+		std::atomic<size_t> seq;
+		T value;
+	};
+
+	std::unique_ptr<cell[]> _cells;
+	size_t _mask = 0;
+
+	// on their own cache lines; producers and consumers hammer different ones.
+	alignas(64) std::atomic<size_t> _tail{0};
+	alignas(64) std::atomic<size_t> _head{0};
+};
+
+#endif
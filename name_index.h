@@ -0,0 +1,124 @@
+#ifndef __name_index_h__
+#define __name_index_h__
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#include <algorithm>
+#include <vector>
+
+/*
+ * the names in one directory listing, for pairing sidecars with their data
+ * files without asking the filesystem.
+ *
+ * names are packed (nul-terminated) into one buffer and hashed into an open
+ * addressed table, so a directory costs two or three allocations however
+ * many entries it has.  clear() keeps the memory for the next directory.
+ * iteration is in listing order, unless sort_by_inode() is called.
+ */
+class name_index {
+public:
+
+	struct entry {
+		uint64_t ino; // 0 if unknown
+		uint32_t offset;
+		uint32_t length;
+		uint32_t hash;
+		unsigned char type; // DT_xxx
+	};
+
+	typedef std::vector<entry>::const_iterator const_iterator;
+
+	void clear() {
+		_names.clear();
+		_entries.clear();
+		std::fill(_table.begin(), _table.end(), 0);
+	}
+
+	size_t size() const { return _entries.size(); }
+
+	// bytes held, including what clear() keeps.
+	size_t memory() const {
+		return _names.capacity() + _entries.capacity() * sizeof(entry) + _table.capacity() * sizeof(uint32_t);
+	}
+	bool empty() const { return _entries.empty(); }
+
+	const_iterator begin() const { return _entries.begin(); }
+	const_iterator end() const { return _entries.end(); }
+
+	const char *name(const entry &e) const { return _names.data() + e.offset; }
+	const char *name(uint32_t offset) const { return _names.data() + offset; }
+
+	void insert(const char *name, size_t length, unsigned char type, uint64_t ino = 0) {
+		if ((_entries.size() + 1) * 2 > _table.size()) grow();
+
+		entry e;
+		e.ino = ino;
+		e.offset = _names.size();
+		e.length = length;
+		e.hash = hash(name, length);
+		e.type = type;
+
+		_names.insert(_names.end(), name, name + length);
+		_names.push_back(0);
+		_entries.push_back(e);
+		place(_entries.size());
+	}
+
+	/*
+	 * on a spinning disk, inode order is much closer to disk order than the
+	 * listing's (which is hash order on ext4).  ties keep listing order.
+	 */
+	void sort_by_inode() {
+		std::sort(_entries.begin(), _entries.end(), [](const entry &a, const entry &b){
+			return a.ino != b.ino ? a.ino < b.ino : a.offset < b.offset;
+		});
+		std::fill(_table.begin(), _table.end(), 0);
+		for (uint32_t i = 1; i <= _entries.size(); ++i) place(i);
+	}
+
+	const entry *find(const char *name, size_t length) const {
+		if (_table.empty()) return nullptr;
+
+		uint32_t h = hash(name, length);
+		size_t mask = _table.size() - 1;
+		for (size_t i = h & mask; _table[i]; i = (i + 1) & mask) {
+			const entry &e = _entries[_table[i] - 1];
+			if (e.hash == h && e.length == length && !memcmp(_names.data() + e.offset, name, length))
+				return &e;
+		}
+		return nullptr;
+	}
+
+private:
+
+	// fnv-1a
+	static uint32_t hash(const char *name, size_t length) {
+		uint32_t h = 2166136261u;
+		for (size_t i = 0; i < length; ++i) {
+			h ^= (unsigned char)name[i];
+			h *= 16777619u;
+		}
+		return h;
+	}
+
+	// _table holds 1 + the entry's position; 0 is empty.
+	void place(uint32_t ix) {
+		size_t mask = _table.size() - 1;
+		size_t i = _entries[ix - 1].hash & mask;
+		while (_table[i]) i = (i + 1) & mask;
+		_table[i] = ix;
+	}
+
+	void grow() {
+		_table.assign(_table.empty() ? 64 : _table.size() * 2, 0);
+		for (uint32_t i = 1; i <= _entries.size(); ++i) place(i);
+	}
+
+	std::vector<char> _names;
+	std::vector<entry> _entries;
+	std::vector<uint32_t> _table;
+};
+
+#endif
@@ -0,0 +1,61 @@
+#!/bin/sh
+#
+# make test: --journal / --resume.
+#
+# usage: test_journal.sh ./dot_clean
+#
+
+bin=$1
+case $bin in
+	/*) ;;
+	*) bin=$PWD/$bin ;;
+esac
+dir=$(mktemp -d "${TMPDIR:-/tmp}/dot_clean_journal.XXXXXX") || exit 1
+trap 'rm -rf "$dir"' EXIT
+cd "$dir" || exit 1
+
+failed=0
+fail() {
+	echo "test_journal: $*" >&2
+	failed=1
+}
+
+# an Apple Double file with a 4 byte resource fork, $2.
+sidecar() {
+	printf '\000\005\026\007\000\002\000\000' > "$1"
+	printf '\000\000\000\000\000\000\000\000\000\000\000\000\000\000\000\000' >> "$1"
+	printf '\000\001\000\000\000\002\000\000\000\046\000\000\000\004%s' "$2" >> "$1"
+}
+
+# t/t4 never finishes: ._bad isn't Apple Double.
+mkdir -p t/t4
+: > t/t4/foo
+sidecar t/t4/._foo one1
+echo 'not apple double' > t/t4/._bad
+: > t/t4/bad
+
+"$bin" -v --journal j t > out 2>&1
+grep -q '^Merging t/t4/._foo &' out || fail "first run didn't merge t/t4/._foo"
+[ -e t/t4/._foo ] && fail "first run didn't delete t/t4/._foo"
+grep -q '^D t/t4/' j && fail "t/t4 shouldn't be finished"
+
+# a sidecar put back after its batch finished is merged again, not just
+# deleted.
+sidecar t/t4/._foo two2
+"$bin" -v --journal j --resume t > out 2>&1
+grep -q '^Merging t/t4/._foo &' out || fail "resume deleted a re-created sidecar without merging it"
+
+# one still in flight (no C record) is deleted straight away.
+sidecar t/t4/._foo tre3
+printf 'dot_clean journal 2\nU 7 t/t4/._foo\n' > j
+"$bin" -v --journal j --resume t > out 2>&1
+[ -e t/t4/._foo ] && fail "resume didn't replay an unfinished unlink"
+grep -q '^Merging t/t4/._foo &' out && fail "resume merged a sidecar it should have replayed"
+
+# a v1 journal isn't read as this one.
+printf 'dot_clean journal 1\n' > j
+"$bin" --journal j --resume t > out 2>&1
+[ $? -eq 65 ] || fail "an old journal was accepted"
+
+[ $failed -eq 0 ] && echo "test_journal: ok"
+exit $failed
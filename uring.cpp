@@ -0,0 +1,146 @@
+#include "uring.h"
+
+#ifdef HAVE_IO_URING
+
+#include <errno.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+namespace {
+
+	int io_uring_setup(unsigned entries, io_uring_params *p) {
+		return syscall(__NR_io_uring_setup, entries, p);
+	}
+
+	int io_uring_enter(int fd, unsigned to_submit, unsigned min_complete, unsigned flags) {
+		return syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, nullptr, 0);
+	}
+
+	int io_uring_register(int fd, unsigned opcode, void *arg, unsigned nr_args) {
+		return syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+	}
+
+	void *map_ring(int fd, size_t size, off_t offset) {
+		void *p = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, offset);
+		return p == MAP_FAILED ? nullptr : p;
+	}
+}
+
+
+bool uring::init(unsigned entries) {
+
+	close();
+
+	io_uring_params p;
+	memset(&p, 0, sizeof(p));
+
+	int fd = io_uring_setup(entries, &p);
+	if (fd < 0) return false;
+	_fd = fd;
+
+	_sq_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+	_cq_size = p.cq_off.cqes + p.cq_entries * sizeof(io_uring_cqe);
+
+	if (p.features & IORING_FEAT_SINGLE_MMAP) {
+		if (_cq_size > _sq_size) _sq_size = _cq_size;
+		_cq_size = 0;
+	}
+
+	_sq_ptr = map_ring(fd, _sq_size, IORING_OFF_SQ_RING);
+	if (!_sq_ptr) return close(), false;
+
+	_cq_ptr = _cq_size ? map_ring(fd, _cq_size, IORING_OFF_CQ_RING) : _sq_ptr;
+	if (!_cq_ptr) return close(), false;
+
+	_sqes_size = p.sq_entries * sizeof(io_uring_sqe);
+	_sqes = (io_uring_sqe *)map_ring(fd, _sqes_size, IORING_OFF_SQES);
+	if (!_sqes) return close(), false;
+
+	char *sq = (char *)_sq_ptr;
+	char *cq = (char *)_cq_ptr;
+
+	_sq_head = (unsigned *)(sq + p.sq_off.head);
+	_sq_tail = (unsigned *)(sq + p.sq_off.tail);
+	_sq_mask = *(unsigned *)(sq + p.sq_off.ring_mask);
+	_sq_entries = p.sq_entries;
+	_sqe_tail = _submitted = *_sq_tail;
+
+	// sqe i always lives in slot i.
+	unsigned *array = (unsigned *)(sq + p.sq_off.array);
+	for (unsigned i = 0; i < _sq_entries; ++i) array[i] = i;
+
+	_cq_head = (unsigned *)(cq + p.cq_off.head);
+	_cq_tail = (unsigned *)(cq + p.cq_off.tail);
+	_cq_mask = *(unsigned *)(cq + p.cq_off.ring_mask);
+	_cqes = (io_uring_cqe *)(cq + p.cq_off.cqes);
+
+	// which opcodes does this kernel know about?
+	const unsigned nops = 256;
+	size_t probe_size = sizeof(io_uring_probe) + nops * sizeof(io_uring_probe_op);
+	io_uring_probe *probe = (io_uring_probe *)calloc(1, probe_size);
+	if (!probe) return close(), false;
+
+	if (io_uring_register(fd, IORING_REGISTER_PROBE, probe, nops) == 0) {
+		for (unsigned i = 0; i <= probe->last_op && i < nops; ++i) {
+			if (probe->ops[i].flags & IO_URING_OP_SUPPORTED)
+				_ops[i >> 5] |= 1u << (i & 31);
+		}
+	}
+	free(probe);
+
+	return true;
+}
+
+void uring::close() {
+	if (_sqes) munmap(_sqes, _sqes_size);
+	if (_cq_ptr && _cq_ptr != _sq_ptr) munmap(_cq_ptr, _cq_size);
+	if (_sq_ptr) munmap(_sq_ptr, _sq_size);
+	if (_fd >= 0) ::close(_fd);
+
+	_fd = -1;
+	_sq_ptr = _cq_ptr = nullptr;
+	_sqes = nullptr;
+	_sq_size = _cq_size = _sqes_size = 0;
+	_sq_entries = 0;
+	_in_flight = 0;
+	memset(_ops, 0, sizeof(_ops));
+}
+
+
+io_uring_sqe *uring::get_sqe() {
+	unsigned head = __atomic_load_n(_sq_head, __ATOMIC_ACQUIRE);
+	if (_sqe_tail - head >= _sq_entries) return nullptr;
+	// completions are reaped by the caller; don't overrun the (2x sized) cq either.
+	if (_in_flight >= _sq_entries) return nullptr;
+
+	io_uring_sqe *sqe = &_sqes[_sqe_tail & _sq_mask];
+	memset(sqe, 0, sizeof(*sqe));
+	_sqe_tail++;
+	_in_flight++;
+	return sqe;
+}
+
+void uring::fail() {
+	perror("io_uring_enter");
+	abort();
+}
+
+int uring::submit(unsigned wait_nr) {
+	unsigned to_submit = _sqe_tail - _submitted;
+	__atomic_store_n(_sq_tail, _sqe_tail, __ATOMIC_RELEASE);
+
+	for(;;) {
+		int rv = io_uring_enter(_fd, to_submit, wait_nr, wait_nr ? IORING_ENTER_GETEVENTS : 0);
+		if (rv < 0 && (errno == EINTR || errno == EAGAIN || errno == EBUSY)) continue;
+		if (rv < 0) return rv;
+		// anything not consumed stays in the ring for the next call.
+		_submitted += rv;
+		return rv;
+	}
+}
+
+#endif
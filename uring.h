@@ -0,0 +1,161 @@
+#ifndef __uring_h__
+#define __uring_h__
+
+/*
+ * minimal io_uring wrapper (raw system calls, no liburing).
+ *
+ * init() fails cleanly on kernels / platforms without io_uring (or when it's
+ * blocked by seccomp) so callers can fall back to plain system calls.
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+
+#if defined(__linux__) && defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+/*
+ * the opcodes are an enum, so look for something from the same release:
+ * unlinkat (and unlink_flags) came with 5.11, as did SQPOLL_NONFIXED.
+ * statx, openat and the probe are older.  the kernel may still be older
+ * than the headers; init() and supports() sort that out.
+ */
+#ifdef IORING_FEAT_SQPOLL_NONFIXED
+#define HAVE_IO_URING 1
+#endif
+#endif
+#endif
+
+#ifdef HAVE_IO_URING
+
+#include <sys/stat.h>
+
+class uring {
+public:
+
+	uring() = default;
+	uring(const uring &) = delete;
+	uring &operator=(const uring &) = delete;
+	~uring() { close(); }
+
+	bool init(unsigned entries);
+	void close();
+
+	bool is_open() const { return _fd >= 0; }
+	explicit operator bool() const { return is_open(); }
+
+	unsigned capacity() const { return _sq_entries; }
+	bool supports(unsigned op) const { return op < 256 && (_ops[op >> 5] & (1u << (op & 31))); }
+
+	// returns nullptr if the submission queue is full.  the sqe is zeroed.
+	io_uring_sqe *get_sqe();
+
+	// the same, but when the ring is full everything in it is finished first
+	// (see drain) rather than failing.
+	template<class FX>
+	io_uring_sqe *get_sqe(FX fx) {
+		io_uring_sqe *sqe = get_sqe();
+		if (!sqe) {
+			drain(fx);
+			sqe = get_sqe();
+		}
+		return sqe;
+	}
+
+	// submit everything queued and wait for wait_nr completions.
+	int submit(unsigned wait_nr = 0);
+
+	// run fx(user_data, res) for each available completion.
+	template<class FX>
+	unsigned reap(FX fx) {
+		unsigned head = *_cq_head;
+		unsigned tail = __atomic_load_n(_cq_tail, __ATOMIC_ACQUIRE);
+		unsigned count = 0;
+		while (head != tail) {
+			const io_uring_cqe &cqe = _cqes[head & _cq_mask];
+			fx(cqe.user_data, cqe.res);
+			++head;
+			++count;
+		}
+		__atomic_store_n(_cq_head, head, __ATOMIC_RELEASE);
+		return count;
+	}
+
+	// submit and reap until all outstanding operations have completed.
+	// requests point into the caller's buffers, so if the kernel refuses to
+	// wait for them there's no safe way to continue: that aborts.
+	template<class FX>
+	void drain(FX fx) {
+		while (_in_flight) {
+			if (submit(1) < 0) fail();
+			_in_flight -= reap(fx);
+		}
+	}
+
+private:
+
+	[[noreturn]] void fail();
+
+	int _fd = -1;
+
+	void *_sq_ptr = nullptr;
+	size_t _sq_size = 0;
+	void *_cq_ptr = nullptr;
+	size_t _cq_size = 0;
+	io_uring_sqe *_sqes = nullptr;
+	size_t _sqes_size = 0;
+
+	unsigned *_sq_head = nullptr;
+	unsigned *_sq_tail = nullptr;
+	unsigned _sq_mask = 0;
+	unsigned _sq_entries = 0;
+	unsigned _sqe_tail = 0;
+	unsigned _submitted = 0;
+
+	unsigned *_cq_head = nullptr;
+	unsigned *_cq_tail = nullptr;
+	unsigned _cq_mask = 0;
+	io_uring_cqe *_cqes = nullptr;
+
+	unsigned _in_flight = 0;
+	uint32_t _ops[8] = {};
+};
+
+
+/* sqe helpers */
+
+inline void prep_openat(io_uring_sqe *sqe, int dirfd, const char *path, int flags, unsigned mode = 0) {
+	sqe->opcode = IORING_OP_OPENAT;
+	sqe->fd = dirfd;
+	sqe->addr = (uintptr_t)path;
+	sqe->len = mode;
+	sqe->open_flags = flags;
+}
+
+inline void prep_statx(io_uring_sqe *sqe, int dirfd, const char *path, int flags, unsigned mask, struct statx *stx) {
+	sqe->opcode = IORING_OP_STATX;
+	sqe->fd = dirfd;
+	sqe->addr = (uintptr_t)path;
+	sqe->len = mask;
+	sqe->off = (uintptr_t)stx;
+	sqe->statx_flags = flags;
+}
+
+inline void prep_read(io_uring_sqe *sqe, int fd, void *buffer, unsigned length, uint64_t offset) {
+	sqe->opcode = IORING_OP_READ;
+	sqe->fd = fd;
+	sqe->addr = (uintptr_t)buffer;
+	sqe->len = length;
+	sqe->off = offset;
+}
+
+inline void prep_unlinkat(io_uring_sqe *sqe, int dirfd, const char *path, int flags) {
+	sqe->opcode = IORING_OP_UNLINKAT;
+	sqe->fd = dirfd;
+	sqe->addr = (uintptr_t)path;
+	sqe->unlink_flags = flags;
+}
+
+#endif
+
+#endif
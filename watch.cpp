@@ -0,0 +1,375 @@
+#include "watch.h"
+
+#include <errno.h>
+
+#ifdef __linux__
+
+#include "dir_scanner.h"
+
+#include <fcntl.h>
+#include <limits.h>
+#include <poll.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <err.h>
+
+#include <sys/fanotify.h>
+#include <sys/inotify.h>
+#include <sys/vfs.h>
+
+namespace {
+
+	const size_t buffer_size = 64 * 1024;
+
+	const uint32_t inotify_mask = IN_CLOSE_WRITE | IN_MOVED_TO | IN_MOVED_FROM | IN_CREATE | IN_ONLYDIR;
+
+	bool is_apple_double(const char *name) {
+		return !strcmp(name, ".AppleDouble");
+	}
+
+	// subdirectories are the only types watch_tree needs.
+	bool need_type(const char *name, size_t) {
+		return name[0] != '.' || is_apple_double(name);
+	}
+
+	/*
+	 * whether a directory (relative to its root, with a trailing '/') is one
+	 * dot_clean doesn't look in: a hidden one, or anything inside an
+	 * .AppleDouble folder.
+	 */
+	bool hidden(const std::string &rel) {
+		size_t start = 0;
+		for (size_t end = rel.find('/'); end != std::string::npos; end = rel.find('/', start)) {
+			if (rel[start] == '.') {
+				bool last = end + 1 == rel.size();
+				if (!last || rel.compare(start, end - start, ".AppleDouble")) return true;
+			}
+			start = end + 1;
+		}
+		return false;
+	}
+
+	std::string with_slash(std::string s) {
+		if (s.empty() || s.back() != '/') s.push_back('/');
+		return s;
+	}
+
+}
+
+bool dir_watch::init(const std::vector<std::string> &roots) {
+	close();
+	_buffer.resize(buffer_size);
+	if (init_fanotify(roots)) return true;
+	close();
+	return init_inotify(roots);
+}
+
+void dir_watch::close() {
+	for (auto &r : _roots) {
+		if (r.mount_fd >= 0) ::close(r.mount_fd);
+	}
+	_roots.clear();
+	_watches.clear();
+	_dirs.clear();
+	if (_fd >= 0) ::close(_fd);
+	_fd = -1;
+	_fanotify = false;
+}
+
+bool dir_watch::read(std::vector<event> &events, int timeout) {
+
+	struct pollfd pfd = { _fd, POLLIN, 0 };
+	int n = poll(&pfd, 1, timeout);
+	if (n < 0) return errno == EINTR;
+	if (n == 0) return true;
+
+	for(;;) {
+		ssize_t size = ::read(_fd, _buffer.data(), _buffer.size());
+		if (size < 0) {
+			if (errno == EAGAIN || errno == EINTR) return true;
+			return false;
+		}
+		if (size == 0) return true;
+		if (_fanotify) read_fanotify(events, _buffer.data(), size);
+		else read_inotify(events, _buffer.data(), size);
+	}
+}
+
+/*
+ * fanotify: events come with the directory's file handle and the name.
+ * the handle is opened (O_PATH) to find out where the directory is, which
+ * is remembered until a directory moves.
+ */
+bool dir_watch::init_fanotify(const std::vector<std::string> &roots) {
+
+	#ifdef FAN_REPORT_DFID_NAME
+	_fd = fanotify_init(FAN_CLASS_NOTIF | FAN_CLOEXEC | FAN_NONBLOCK | FAN_REPORT_DFID_NAME, O_RDONLY | O_LARGEFILE);
+	if (_fd < 0) return false;
+	_fanotify = true;
+
+	for (const auto &path : roots) {
+		root r;
+		r.display = with_slash(path);
+		r.mount_fd = open(path.c_str(), O_RDONLY | O_DIRECTORY);
+		if (r.mount_fd < 0) return false;
+		_roots.push_back(r);
+
+		char real[PATH_MAX];
+		struct statfs st;
+		if (!realpath(path.c_str(), real) || fstatfs(r.mount_fd, &st) < 0) return false;
+		_roots.back().real = real;
+		static_assert(sizeof(st.f_fsid) == sizeof(r.fsid), "fsid");
+		memcpy(_roots.back().fsid, &st.f_fsid, sizeof(r.fsid));
+
+		uint64_t mask = FAN_CLOSE_WRITE | FAN_MOVED_TO | FAN_MOVED_FROM | FAN_CREATE | FAN_ONDIR;
+		if (fanotify_mark(_fd, FAN_MARK_ADD | FAN_MARK_FILESYSTEM, mask, r.mount_fd, nullptr) < 0) return false;
+
+		// and handles have to open (CAP_DAC_READ_SEARCH).
+		union {
+			struct file_handle fh;
+			char buffer[sizeof(struct file_handle) + MAX_HANDLE_SZ];
+		} h;
+		int mount_id;
+		h.fh.handle_bytes = MAX_HANDLE_SZ;
+		if (name_to_handle_at(r.mount_fd, "", &h.fh, &mount_id, AT_EMPTY_PATH) < 0) return false;
+		int fd = open_by_handle_at(r.mount_fd, &h.fh, O_PATH);
+		if (fd < 0) return false;
+		::close(fd);
+	}
+	return true;
+	#else
+	(void)roots;
+	return false;
+	#endif
+}
+
+// the directory's real path, or "" if it's gone.
+bool dir_watch::resolve(const root &r, const void *handle, std::string &dir) {
+
+	const struct file_handle *fh = (const struct file_handle *)handle;
+	std::string key((const char *)r.fsid, sizeof(r.fsid));
+	key.append((const char *)fh, sizeof(*fh) + fh->handle_bytes);
+
+	auto iter = _dirs.find(key);
+	if (iter != _dirs.end()) {
+		dir = iter->second;
+		return !dir.empty();
+	}
+
+	dir.clear();
+	int fd = open_by_handle_at(r.mount_fd, (struct file_handle *)fh, O_PATH);
+	if (fd >= 0) {
+		char link[64];
+		char path[PATH_MAX];
+		snprintf(link, sizeof(link), "/proc/self/fd/%d", fd);
+		ssize_t n = readlink(link, path, sizeof(path));
+		if (n > 0 && n < (ssize_t)sizeof(path)) dir.assign(path, n);
+		::close(fd);
+	}
+	if (_dirs.size() >= 65536) _dirs.clear();
+	_dirs.emplace(std::move(key), dir);
+	return !dir.empty();
+}
+
+// a directory moved away: it and everything under it have new paths.
+void dir_watch::forget(const std::string &dir) {
+	std::string prefix = with_slash(dir);
+	for (auto iter = _dirs.begin(); iter != _dirs.end(); ) {
+		const std::string &d = iter->second;
+		if (d == dir || !d.compare(0, prefix.size(), prefix)) iter = _dirs.erase(iter);
+		else ++iter;
+	}
+}
+
+void dir_watch::read_fanotify(std::vector<event> &events, const char *buffer, size_t size) {
+
+	#ifdef FAN_REPORT_DFID_NAME
+	const struct fanotify_event_metadata *m = (const struct fanotify_event_metadata *)buffer;
+	ssize_t len = size;
+	for (; FAN_EVENT_OK(m, len); m = FAN_EVENT_NEXT(m, len)) {
+		if (m->vers != FANOTIFY_METADATA_VERSION) continue;
+		if (m->mask & FAN_Q_OVERFLOW) {
+			// and moves with them.
+			_dirs.clear();
+			events.push_back(event{ event::overflow, std::string(), std::string() });
+			continue;
+		}
+
+		bool is_dir = m->mask & FAN_ONDIR;
+		if (is_dir && !(m->mask & (FAN_CREATE | FAN_MOVED_TO | FAN_MOVED_FROM))) continue;
+		if (!is_dir && !(m->mask & (FAN_CLOSE_WRITE | FAN_MOVED_TO))) continue;
+
+		const char *cp = (const char *)m + m->metadata_len;
+		const char *end = (const char *)m + m->event_len;
+		while (cp + sizeof(struct fanotify_event_info_header) <= end) {
+			const struct fanotify_event_info_fid *info = (const struct fanotify_event_info_fid *)cp;
+			if (info->hdr.len == 0) break;
+			cp += info->hdr.len;
+			if (info->hdr.info_type != FAN_EVENT_INFO_TYPE_DFID_NAME) continue;
+
+			const struct file_handle *fh = (const struct file_handle *)info->handle;
+			const char *name = (const char *)fh->f_handle + fh->handle_bytes;
+
+			if (is_dir && (m->mask & FAN_MOVED_FROM)) {
+				for (const auto &r : _roots) {
+					std::string parent;
+					if (memcmp(&info->fsid, r.fsid, sizeof(r.fsid)) || !resolve(r, fh, parent)) continue;
+					forget(with_slash(parent) + name);
+					break;
+				}
+				if (!(m->mask & (FAN_CREATE | FAN_MOVED_TO))) continue;
+			}
+			if (is_dir && name[0] == '.') continue;
+
+			std::string real;
+			for (const auto &r : _roots) {
+				if (memcmp(&info->fsid, r.fsid, sizeof(r.fsid))) continue;
+				if (real.empty() && !resolve(r, fh, real)) break;
+
+				std::string prefix = with_slash(r.real);
+				std::string rel;
+				if (real != r.real) {
+					if (real.compare(0, prefix.size(), prefix)) continue;
+					rel = real.substr(prefix.size()) + '/';
+				}
+				if (hidden(rel)) continue;
+				events.push_back(event{ is_dir ? event::directory : event::file, r.display + rel, name });
+			}
+		}
+	}
+	#else
+	(void)events;
+	(void)buffer;
+	(void)size;
+	#endif
+}
+
+/*
+ * inotify: a watch per directory.  a new directory is watched (with what's
+ * already in it) as soon as it's seen; one moved away is forgotten.
+ */
+bool dir_watch::init_inotify(const std::vector<std::string> &roots) {
+
+	_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+	if (_fd < 0) return false;
+
+	for (const auto &path : roots) {
+		std::string dir = with_slash(path);
+		if (inotify_add_watch(_fd, dir.c_str(), inotify_mask) < 0) {
+			int e = errno;
+			close();
+			errno = e;
+			return false;
+		}
+		watch_tree(dir);
+	}
+	return true;
+}
+
+void dir_watch::watch_tree(const std::string &top) {
+
+	dir_scanner scanner;
+	dir_scanner::entry e;
+	std::vector<std::string> stack(1, top);
+
+	while (!stack.empty()) {
+		std::string dir = std::move(stack.back());
+		stack.pop_back();
+
+		int wd = inotify_add_watch(_fd, dir.c_str(), inotify_mask);
+		if (wd < 0) {
+			if (errno == ENOSPC && !_warned) {
+				warnx("inotify watch limit reached (fs.inotify.max_user_watches); some directories aren't watched");
+				_warned = true;
+			}
+			continue;
+		}
+		_watches[wd] = dir;
+
+		// nothing inside an .AppleDouble folder is looked at.
+		size_t n = dir.size();
+		if (n >= 13 && !dir.compare(n - 13, 13, ".AppleDouble/")) continue;
+
+		int fd = open(dir.c_str(), O_RDONLY | O_DIRECTORY);
+		if (fd < 0) continue;
+		if (scanner.open(fd, need_type)) {
+			while (scanner.next(e)) {
+				if (e.type != DT_DIR || !need_type(e.name, e.length)) continue;
+				stack.push_back(dir + e.name + '/');
+			}
+			scanner.close();
+		}
+		::close(fd);
+	}
+}
+
+void dir_watch::unwatch_tree(const std::string &dir) {
+	for (auto iter = _watches.begin(); iter != _watches.end(); ) {
+		if (iter->second.compare(0, dir.size(), dir)) {
+			++iter;
+			continue;
+		}
+		inotify_rm_watch(_fd, iter->first);
+		iter = _watches.erase(iter);
+	}
+}
+
+void dir_watch::read_inotify(std::vector<event> &events, const char *buffer, size_t size) {
+
+	for (size_t offset = 0; offset + sizeof(struct inotify_event) <= size; ) {
+		const struct inotify_event *ev = (const struct inotify_event *)(buffer + offset);
+		offset += sizeof(struct inotify_event) + ev->len;
+
+		if (ev->mask & IN_Q_OVERFLOW) {
+			events.push_back(event{ event::overflow, std::string(), std::string() });
+			continue;
+		}
+
+		auto iter = _watches.find(ev->wd);
+		if (iter == _watches.end()) continue;
+		if (ev->mask & IN_IGNORED) {
+			_watches.erase(iter);
+			continue;
+		}
+		if (!ev->len) continue;
+
+		// a copy: watching a new tree can rehash _watches.
+		std::string dir = iter->second;
+		const char *name = ev->name;
+
+		if (ev->mask & IN_ISDIR) {
+			if (ev->mask & IN_MOVED_FROM) {
+				unwatch_tree(dir + name + '/');
+				continue;
+			}
+			if (!(ev->mask & (IN_CREATE | IN_MOVED_TO))) continue;
+			if (!need_type(name, ev->len)) continue;
+			size_t n = dir.size();
+			if (n >= 13 && !dir.compare(n - 13, 13, ".AppleDouble/")) continue;
+
+			watch_tree(dir + name + '/');
+			if (!is_apple_double(name)) events.push_back(event{ event::directory, dir, name });
+			continue;
+		}
+
+		if (ev->mask & (IN_CLOSE_WRITE | IN_MOVED_TO))
+			events.push_back(event{ event::file, dir, name });
+	}
+}
+
+#else
+
+bool dir_watch::init(const std::vector<std::string> &) {
+	errno = ENOSYS;
+	return false;
+}
+
+void dir_watch::close() {}
+
+bool dir_watch::read(std::vector<event> &, int) {
+	errno = ENOSYS;
+	return false;
+}
+
+#endif
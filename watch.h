@@ -0,0 +1,87 @@
+#ifndef __watch_h__
+#define __watch_h__
+
+#include <string>
+#include <vector>
+
+#ifdef __linux__
+#include <unordered_map>
+#endif
+
+/*
+ * new files under a set of directory trees (linux).
+ *
+ * fanotify with a filesystem mark is preferred -- one mark, however big the
+ * tree -- but needs CAP_SYS_ADMIN and a 5.9 kernel; otherwise every
+ * directory gets an inotify watch, and new ones are watched as they appear.
+ *
+ * only finished files are reported (closed after writing, or renamed into
+ * place), and new directories.  hidden directories other than .AppleDouble
+ * aren't looked into.  init() fails elsewhere, with ENOSYS.
+ */
+class dir_watch {
+public:
+
+	struct event {
+		enum kind_type { file, directory, overflow };
+
+		kind_type kind;
+		std::string dir; // with a trailing '/', under the root as given.
+		std::string name;
+	};
+
+	dir_watch() = default;
+	~dir_watch() { close(); }
+
+	dir_watch(const dir_watch &) = delete;
+	dir_watch &operator=(const dir_watch &) = delete;
+
+	// sets errno on failure.
+	bool init(const std::vector<std::string> &roots);
+	void close();
+
+	// "fanotify" or "inotify".
+	const char *method() const { return _fanotify ? "fanotify" : "inotify"; }
+
+	/*
+	 * appends whatever has happened, waiting up to timeout ms (-1 for ever)
+	 * if nothing has.  a signal ends the wait early.  false (with errno) on
+	 * error.  an overflow means events were lost.
+	 */
+	bool read(std::vector<event> &events, int timeout);
+
+private:
+
+	int _fd = -1;
+	bool _fanotify = false;
+
+#ifdef __linux__
+	struct root {
+		std::string display; // as given, with a trailing '/'
+		std::string real;    // realpath()
+		int mount_fd;
+		int fsid[2];
+	};
+
+	bool init_fanotify(const std::vector<std::string> &roots);
+	bool init_inotify(const std::vector<std::string> &roots);
+	void watch_tree(const std::string &dir);
+	void unwatch_tree(const std::string &dir);
+	void read_fanotify(std::vector<event> &events, const char *buffer, size_t size);
+	void read_inotify(std::vector<event> &events, const char *buffer, size_t size);
+	bool resolve(const root &r, const void *handle, std::string &dir);
+	void forget(const std::string &dir);
+
+	std::vector<root> _roots;
+	std::vector<char> _buffer;
+
+	// inotify: watch descriptor -> directory.
+	std::unordered_map<int, std::string> _watches;
+	bool _warned = false;
+
+	// fanotify: file handle -> directory ("" if it's outside the roots).
+	std::unordered_map<std::string, std::string> _dirs;
+#endif
+};
+
+#endif
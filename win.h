@@ -45,9 +45,147 @@
 	fprintf(stderr, __VA_ARGS__); \
 } while(0)
 
+#define err(code, ...) do { \
+	warn(__VA_ARGS__); \
+	exit(code); \
+} while(0)
+
+#define errx(code, ...) do { \
+	warnx(__VA_ARGS__); \
+	exit(code); \
+} while(0)
+
 #define warnc(ec, ...) do { \
 	char *cp = strerror(ec); \
 	fputs("dot_clean: ", stderr); \
 	fprintf(stderr, __VA_ARGS__); \
 	fprintf(stderr,": %s", cp); \
 } while(0)
+
+/*
+ * *at() emulation.  a directory descriptor is a real descriptor (opened on
+ * NUL) that indexes a table of paths; everything else resolves the path and
+ * calls the plain function.
+ */
+
+#include <string>
+#include <map>
+#include <mutex>
+#include <io.h>
+#include <direct.h>
+#include <process.h>
+#include <stdio.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <dirent.h>
+#include <sys/stat.h>
+
+#define AT_FDCWD -100
+#define AT_SYMLINK_NOFOLLOW 0x100
+#define AT_REMOVEDIR 0x200
+
+#ifndef O_DIRECTORY
+#define O_DIRECTORY 0x200000
+#endif
+
+namespace win_at {
+
+	inline std::mutex &table_mutex() {
+		static std::mutex m;
+		return m;
+	}
+
+	inline std::map<int, std::string> &table() {
+		static std::map<int, std::string> t;
+		return t;
+	}
+
+	inline std::string path(int dirfd, const char *name) {
+		if (dirfd == AT_FDCWD) return name;
+		if (name[0] == '/' || name[0] == '\\' || (name[0] && name[1] == ':')) return name;
+
+		std::lock_guard<std::mutex> lk(table_mutex());
+		return table()[dirfd] + "/" + name;
+	}
+
+	inline int openat(int dirfd, const char *name, int flags, int mode = 0) {
+		std::string p = path(dirfd, name);
+		if (!(flags & O_DIRECTORY)) return ::open(p.c_str(), flags, mode);
+
+		struct stat st;
+		if (::stat(p.c_str(), &st) < 0) return -1;
+		if (!S_ISDIR(st.st_mode)) { errno = ENOTDIR; return -1; }
+
+		int fd = ::open("NUL", O_RDONLY);
+		if (fd < 0) return -1;
+		std::lock_guard<std::mutex> lk(table_mutex());
+		table()[fd] = p;
+		return fd;
+	}
+
+	inline int dup(int fd) {
+		int rv = ::_dup(fd);
+		if (rv < 0) return rv;
+		std::lock_guard<std::mutex> lk(table_mutex());
+		auto iter = table().find(fd);
+		if (iter != table().end()) table()[rv] = iter->second;
+		return rv;
+	}
+
+	/* a directory descriptor takes its path with it. */
+	inline int close_dir(int fd) {
+		{
+			std::lock_guard<std::mutex> lk(table_mutex());
+			table().erase(fd);
+		}
+		return ::close(fd);
+	}
+
+	inline int fstatat(int dirfd, const char *name, struct stat *st, int flags) {
+		return ::stat(path(dirfd, name).c_str(), st);
+	}
+
+	inline int unlinkat(int dirfd, const char *name, int flags) {
+		std::string p = path(dirfd, name);
+		return flags & AT_REMOVEDIR ? ::rmdir(p.c_str()) : ::unlink(p.c_str());
+	}
+
+	inline int renameat(int olddirfd, const char *oldname, int newdirfd, const char *newname) {
+		return ::rename(path(olddirfd, oldname).c_str(), path(newdirfd, newname).c_str());
+	}
+
+	/* like the real thing, takes ownership of fd. */
+	inline DIR *fdopendir(int fd) {
+		std::string p;
+		{
+			std::lock_guard<std::mutex> lk(table_mutex());
+			auto iter = table().find(fd);
+			if (iter == table().end()) { errno = EBADF; return nullptr; }
+			p = iter->second;
+			table().erase(iter);
+		}
+		::close(fd);
+		return ::opendir(p.c_str());
+	}
+
+	/* no positional reads; fine as long as the descriptor isn't shared. */
+	inline ssize_t pread(int fd, void *buffer, size_t size, long long offset) {
+		if (::_lseeki64(fd, offset, SEEK_SET) < 0) return -1;
+		return ::_read(fd, buffer, (unsigned)size);
+	}
+}
+
+#define openat win_at::openat
+#define dup win_at::dup
+#define close_dir win_at::close_dir
+#define fstatat win_at::fstatat
+#define unlinkat win_at::unlinkat
+#define renameat win_at::renameat
+#define fdopendir win_at::fdopendir
+#define pread win_at::pread
+
+/* no permissions to give it. */
+inline int mkdir(const char *path, int mode) {
+	(void)mode;
+	return ::_mkdir(path);
+}
@@ -0,0 +1,147 @@
+#ifndef __work_pool_h__
+#define __work_pool_h__
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <chrono>
+#include <utility>
+#include <vector>
+
+/*
+ * work-stealing thread pool.
+ *
+ * each worker owns a deque.  work pushed from inside a worker goes onto that
+ * worker's deque and is popped LIFO (depth first); an idle worker steals FIFO
+ * from the others (breadth first, so it gets a large piece of the tree).
+ * work pushed from outside goes onto the far end, so it's taken in the order
+ * it was pushed (command line directories are visited in order).
+ *
+ * run() uses the calling thread as worker 0 so a pool of 1 never creates a
+ * thread.  it returns once every task (including those pushed by tasks) is
+ * done.
+ */
+
+template<class T>
+class work_pool {
+public:
+	typedef std::function<void(T &&)> FX;
+
+	explicit work_pool(unsigned threads = 1) : _queues(threads ? threads : 1) {
+		for (auto &q : _queues) q.reset(new queue);
+	}
+
+	work_pool(const work_pool &) = delete;
+	work_pool &operator=(const work_pool &) = delete;
+
+	unsigned size() const { return _queues.size(); }
+
+	// tasks waiting in a deque (not counting running ones).
+	unsigned queued() const { return _queued; }
+
+	void push(T &&t) {
+		unsigned ix = current();
+		bool outside = ix == none;
+		if (outside) ix = _next++ % _queues.size();
+
+		_pending++;
+		_queued++;
+		{
+			std::lock_guard<std::mutex> lk(_queues[ix]->mutex);
+			if (outside) _queues[ix]->items.push_front(std::move(t));
+			else _queues[ix]->items.push_back(std::move(t));
+		}
+		if (_idle) _cv.notify_one();
+	}
+
+	void push(const T &t) {
+		T tmp(t);
+		push(std::move(tmp));
+	}
+
+	void run(FX fx) {
+		std::vector<std::thread> threads;
+		for (unsigned i = 1; i < _queues.size(); ++i)
+			threads.emplace_back([this, &fx, i]{ worker(fx, i); });
+
+		worker(fx, 0);
+		for (auto &t : threads) t.join();
+	}
+
+private:
+	static const unsigned none = ~0u;
+
+	struct queue {
+		std::mutex mutex;
+		std::deque<T> items;
+	};
+
+	static unsigned &current() {
+		static thread_local unsigned ix = none;
+		return ix;
+	}
+
+	bool pop(unsigned ix, T &t) {
+		auto &q = *_queues[ix];
+		std::lock_guard<std::mutex> lk(q.mutex);
+		if (q.items.empty()) return false;
+		t = std::move(q.items.back());
+		q.items.pop_back();
+		_queued--;
+		return true;
+	}
+
+	bool steal(unsigned ix, T &t) {
+		unsigned n = _queues.size();
+		for (unsigned i = 1; i < n; ++i) {
+			auto &q = *_queues[(ix + i) % n];
+			std::lock_guard<std::mutex> lk(q.mutex);
+			if (q.items.empty()) continue;
+			t = std::move(q.items.front());
+			q.items.pop_front();
+			_queued--;
+			return true;
+		}
+		return false;
+	}
+
+	void worker(FX &fx, unsigned ix) {
+		current() = ix;
+
+		for(;;) {
+			T t;
+			if (pop(ix, t) || steal(ix, t)) {
+				fx(std::move(t));
+				if (--_pending == 0) {
+					std::lock_guard<std::mutex> lk(_mutex);
+					_cv.notify_all();
+				}
+				continue;
+			}
+
+			std::unique_lock<std::mutex> lk(_mutex);
+			if (_pending == 0) break;
+			_idle++;
+			// wake up periodically in case a push raced with going idle.
+			_cv.wait_for(lk, std::chrono::milliseconds(10));
+			_idle--;
+		}
+		current() = none;
+	}
+
+	std::vector<std::unique_ptr<queue>> _queues;
+
+	std::atomic<unsigned> _pending{0};
+	std::atomic<unsigned> _queued{0};
+	std::atomic<unsigned> _idle{0};
+	std::atomic<unsigned> _next{0};
+
+	std::mutex _mutex;
+	std::condition_variable _cv;
+};
+
+#endif